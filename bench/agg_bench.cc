@@ -0,0 +1,275 @@
+#include <openssl/rand.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "hm.h"
+#include "gqf_int.h"
+#include "iceberg_table.h"
+
+using namespace std::chrono;
+
+// Group-by SUM of an event stream, one (key, value) per event:
+//  - lookup then reinsert into the map, as done before hm_aggregate;
+//  - hm_aggregate straight into the map;
+//  - a pipeline: threads pre-aggregate into small local maps and fold them
+//    into the main map with hm_aggregate_merge, then the result is scanned;
+//  - folding partial maps of the whole stream into the main map, one
+//    hm_aggregate per item against hm_aggregate_merge with more threads;
+//  - iceberg (lookup, remove, reinsert) and abseil baselines.
+// Usage: agg_bench [log_slots] [events per group] [max_threads]
+
+uint64_t log_slots = 22;
+uint64_t nslots = (1ULL << log_slots);
+uint64_t events_per_group = 8;
+uint32_t max_threads = std::thread::hardware_concurrency();
+float load_factor = 0.95;
+float group_load = 0.8;
+const uint64_t key_bits = 40;
+const uint64_t key_mask = (1ULL << key_bits) - 1;
+const uint64_t value_bits = 32;
+const uint64_t local_log_slots = 14;
+const uint32_t nparts = 4;
+
+uint64_t ngroups, nevents;
+uint64_t *groups, *event_keys, *event_values;
+uint64_t expected_sum = 0;
+
+void report(const char *name, time_point<high_resolution_clock> begin,
+            uint64_t ngroups_found, uint64_t sum) {
+  auto duration =
+      duration_cast<nanoseconds>(high_resolution_clock::now() - begin);
+  printf("%s: ms: %.2f Mevents/s: %.2f groups: %ld\n", name,
+         duration.count() / 1e6, nevents * 1e3 / duration.count(),
+         ngroups_found);
+  if (ngroups_found != ngroups || sum != expected_sum)
+    fprintf(stderr, "%s: got %ld groups summing to %ld, expected %ld and %ld.\n",
+            name, ngroups_found, sum, ngroups, expected_sum);
+}
+
+// Scan the map in hash order, as the last stage of the pipeline.
+void scan_result(const HM *hm, uint64_t *ngroups_found, uint64_t *sum) {
+  uint64_t hashes[QF_JOIN_BATCH], values[QF_JOIN_BATCH];
+  size_t n;
+  QFi qfi;
+  *ngroups_found = *sum = 0;
+  qf_iterator_from_position(hm, &qfi, 0);
+  while ((n = qfi_next_batch(&qfi, hashes, values, QF_JOIN_BATCH)) > 0) {
+    for (size_t i = 0; i < n; i++)
+      *sum += values[i];
+    *ngroups_found += n;
+  }
+}
+
+void reinsert_test() {
+  HM hm;
+  hm_malloc(&hm, nslots, key_bits, value_bits, QF_HASH_NONE, 0, load_factor);
+  auto begin = high_resolution_clock::now();
+  for (uint64_t i = 0; i < nevents; i++) {
+    uint64_t value = 0;
+    if (hm_lookup(&hm, event_keys[i], &value, QF_NO_LOCK | QF_KEY_IS_HASH) >= 0)
+      hm_remove(&hm, event_keys[i], QF_NO_LOCK | QF_KEY_IS_HASH);
+    hm_insert(&hm, event_keys[i], value + event_values[i],
+              QF_NO_LOCK | QF_KEY_IS_HASH);
+  }
+  uint64_t found, sum;
+  scan_result(&hm, &found, &sum);
+  report("GZHM lookup+reinsert", begin, found, sum);
+  hm_free(&hm);
+}
+
+void aggregate_test() {
+  HM hm;
+  hm_malloc(&hm, nslots, key_bits, value_bits, QF_HASH_NONE, 0, load_factor);
+  auto begin = high_resolution_clock::now();
+  for (uint64_t i = 0; i < nevents; i++)
+    hm_aggregate(&hm, event_keys[i], event_values[i], HM_AGG_SUM,
+                 QF_NO_LOCK | QF_KEY_IS_HASH);
+  uint64_t found, sum;
+  scan_result(&hm, &found, &sum);
+  report("GZHM aggregate", begin, found, sum);
+  hm_free(&hm);
+}
+
+void pipeline_test(uint32_t nthreads) {
+  HM hm;
+  hm_malloc(&hm, nslots, key_bits, value_bits, QF_HASH_NONE, 0, load_factor);
+  std::mutex flush_lock;
+  const uint64_t local_slots = 1ULL << local_log_slots;
+  auto worker = [&](uint32_t tid) {
+    HM local;
+    hm_malloc(&local, local_slots, key_bits, value_bits, QF_HASH_NONE, 0,
+              load_factor);
+    auto flush = [&]() {
+      {
+        std::lock_guard<std::mutex> guard(flush_lock);
+        hm_aggregate_merge(&hm, &local, HM_AGG_SUM, 1, QF_NO_LOCK);
+      }
+      hm_free(&local);
+      hm_malloc(&local, local_slots, key_bits, value_bits, QF_HASH_NONE, 0,
+                load_factor);
+    };
+    for (uint64_t i = tid; i < nevents; i += nthreads) {
+      if (local.metadata->nelts >= local_slots * 0.9)
+        flush();
+      hm_aggregate(&local, event_keys[i], event_values[i], HM_AGG_SUM,
+                   QF_NO_LOCK | QF_KEY_IS_HASH);
+    }
+    flush();
+    hm_free(&local);
+  };
+
+  auto begin = high_resolution_clock::now();
+  std::vector<std::thread> threads;
+  for (uint32_t t = 1; t < nthreads; t++)
+    threads.emplace_back(worker, t);
+  worker(0);
+  for (auto &thread : threads)
+    thread.join();
+  uint64_t found, sum;
+  scan_result(&hm, &found, &sum);
+  char name[64];
+  snprintf(name, sizeof(name), "GZHM pipeline threads %u", nthreads);
+  report(name, begin, found, sum);
+  hm_free(&hm);
+}
+
+// Fold `part` into `hm` one item at a time, probing `hm` for each key.
+void probe_merge(HM *hm, const HM *part) {
+  uint64_t hashes[QF_JOIN_BATCH], values[QF_JOIN_BATCH];
+  size_t n;
+  QFi qfi;
+  qf_iterator_from_position(part, &qfi, 0);
+  while ((n = qfi_next_batch(&qfi, hashes, values, QF_JOIN_BATCH)) > 0) {
+    for (size_t i = 0; i < n; i++)
+      hm_aggregate(hm, hashes[i], values[i], HM_AGG_SUM,
+                   QF_NO_LOCK | QF_KEY_IS_HASH);
+  }
+}
+
+// Each part pre-aggregates every nparts-th event, so it holds most groups.
+// The main map starts with every group at 0, as after earlier merges, and
+// only folding the parts into it is timed.
+void merge_test() {
+  std::vector<HM> parts(nparts);
+  for (uint32_t p = 0; p < nparts; p++) {
+    hm_malloc(&parts[p], nslots, key_bits, value_bits, QF_HASH_NONE, 0,
+              load_factor);
+    for (uint64_t i = p; i < nevents; i += nparts)
+      hm_aggregate(&parts[p], event_keys[i], event_values[i], HM_AGG_SUM,
+                   QF_NO_LOCK | QF_KEY_IS_HASH);
+  }
+
+  for (uint32_t nthreads = 0; nthreads <= max_threads;
+       nthreads = nthreads ? nthreads * 2 : 1) {
+    HM hm;
+    hm_malloc(&hm, nslots, key_bits, value_bits, QF_HASH_NONE, 0, load_factor);
+    for (uint64_t g = 0; g < ngroups; g++)
+      hm_insert(&hm, groups[g], 0, QF_NO_LOCK | QF_KEY_IS_HASH);
+    auto begin = high_resolution_clock::now();
+    for (uint32_t p = 0; p < nparts; p++) {
+      if (nthreads == 0)
+        probe_merge(&hm, &parts[p]);
+      else
+        hm_aggregate_merge(&hm, &parts[p], HM_AGG_SUM, nthreads, QF_NO_LOCK);
+    }
+    uint64_t found, sum;
+    scan_result(&hm, &found, &sum);
+    char name[64];
+    if (nthreads == 0)
+      snprintf(name, sizeof(name), "GZHM merge by probe");
+    else
+      snprintf(name, sizeof(name), "GZHM aggregate_merge threads %u",
+               nthreads);
+    report(name, begin, found, sum);
+    hm_free(&hm);
+  }
+  for (uint32_t p = 0; p < nparts; p++)
+    hm_free(&parts[p]);
+}
+
+void iceberg_test() {
+  iceberg_table ice;
+  iceberg_init(&ice, log_slots);
+  auto begin = high_resolution_clock::now();
+  for (uint64_t i = 0; i < nevents; i++) {
+    uint64_t value = 0;
+    if (iceberg_get_value(&ice, event_keys[i], &value, 0))
+      iceberg_remove(&ice, event_keys[i], 0);
+    iceberg_insert(&ice, event_keys[i], value + event_values[i], 0);
+  }
+  uint64_t found = 0, sum = 0, value;
+  for (uint64_t g = 0; g < ngroups; g++) {
+    if (iceberg_get_value(&ice, groups[g], &value, 0)) {
+      found++;
+      sum += value;
+    }
+  }
+  report("ICEBERG", begin, found, sum);
+}
+
+void absl_test() {
+  absl::flat_hash_map<uint64_t, uint64_t> map;
+  map.reserve(ngroups);
+  auto begin = high_resolution_clock::now();
+  for (uint64_t i = 0; i < nevents; i++)
+    map[event_keys[i]] += event_values[i];
+  uint64_t sum = 0;
+  for (const auto &entry : map)
+    sum += entry.second;
+  report("ABSL", begin, map.size(), sum);
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1) {
+    log_slots = atoll(argv[1]);
+    nslots = 1ULL << log_slots;
+  }
+  if (argc > 2)
+    events_per_group = atoll(argv[2]);
+  if (argc > 3)
+    max_threads = atoi(argv[3]);
+  if (max_threads == 0)
+    max_threads = 1;
+
+  ngroups = group_load * nslots;
+  nevents = events_per_group * ngroups;
+  groups = new uint64_t[ngroups];
+  event_keys = new uint64_t[nevents];
+  event_values = new uint64_t[nevents];
+  RAND_bytes((unsigned char *)groups, ngroups * sizeof(uint64_t));
+  RAND_bytes((unsigned char *)event_keys, nevents * sizeof(uint64_t));
+  RAND_bytes((unsigned char *)event_values, nevents * sizeof(uint64_t));
+  // Distinct group keys, each seen at least once.
+  {
+    absl::flat_hash_map<uint64_t, bool> seen;
+    for (uint64_t g = 0; g < ngroups; g++) {
+      groups[g] &= key_mask;
+      while (groups[g] == 0 || !seen.insert({groups[g], true}).second)
+        groups[g] = (groups[g] * 0x9E3779B97F4A7C15ULL + 1) & key_mask;
+    }
+  }
+  for (uint64_t i = 0; i < nevents; i++) {
+    event_keys[i] = i < ngroups ? groups[i] : groups[event_keys[i] % ngroups];
+    event_values[i] &= 0xffff;
+    expected_sum += event_values[i];
+  }
+  printf("nslots: %ld groups: %ld events: %ld\n", nslots, ngroups, nevents);
+
+  reinsert_test();
+  aggregate_test();
+  for (uint32_t nthreads = 1; nthreads <= max_threads; nthreads *= 2)
+    pipeline_test(nthreads);
+  merge_test();
+  iceberg_test();
+  absl_test();
+
+  delete[] groups;
+  delete[] event_keys;
+  delete[] event_values;
+  return 0;
+}
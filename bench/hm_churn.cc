@@ -11,11 +11,13 @@
 #include <time.h>
 #include <unistd.h>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <fstream>
 #include <iostream>
 #include <chrono>
 #include <set>
+#include <algorithm>
 using namespace std;
 using namespace std::chrono;
 
@@ -26,6 +28,7 @@ using namespace std::chrono;
 #define BITMASK(nbits) ((nbits) == 64 ? 0xffffffffffffffff : MAX_VALUE(nbits))
 
 int key_bits = 16;
+int key_universe_bits = 16; // Width of the generated keys.
 int quotient_bits = 8;
 int value_bits = 8;
 int initial_load_factor = 95;
@@ -33,6 +36,9 @@ int nchurns = 10;
 int nchurn_insert_ops = 500;
 int nchurn_delete_ops = 500;
 int nchurn_lookup_ops = 500;
+int nchurn_neg_lookup_ops = 0;
+int nchurn_cache_ops = 0;
+int cache_skew = 99; // Zipf exponent of cache accesses, in hundredths.
 int npoints = 50;
 int should_record = 0;
 int churn_latency_bucket_size = 10; // Latency is sampled as instantaneous latency of 10 operations.
@@ -51,6 +57,12 @@ uint64_t false_deletes;
 uint64_t total_lookups;
 uint64_t total_deletes;
 uint64_t total_inserts;
+uint64_t false_positives;
+uint64_t total_neg_lookups;
+uint64_t cache_hits;
+uint64_t total_cache_accesses;
+std::vector<uint64_t> cache_keys; // Keys cache accesses are drawn from.
+std::vector<double> cache_key_cdf;
 FILE *LOG;
 
 struct HmMetadataMeasure {
@@ -72,6 +84,10 @@ struct ThrputMeasure {
   uint64_t total_lookups;
   uint64_t total_deletes;
   uint64_t total_inserts;
+  uint64_t false_positives;
+  uint64_t total_neg_lookups;
+  uint64_t cache_hits;
+  uint64_t total_cache_accesses;
   double thrput() {
     return 1.0 * num_ops / ((end_ts - start_ts).count());
   }
@@ -125,10 +141,10 @@ void write_churn_thrput_by_phase_to_file(
   FILE *fp = fopen(filename.c_str(), "a");
   if(write_headers) {
     printf("Writing Log\n");
-    fprintf(fp, "churn_cycle  ts  duration   num_ops  false_lookups total_lookups false_delete total_delete total_inserts op\n");
+    fprintf(fp, "churn_cycle  ts  duration   num_ops  false_lookups total_lookups false_delete total_delete total_inserts false_positives total_neg_lookups cache_hits total_cache_accesses op\n");
   }
   for (auto measure: measures) {
-      fprintf(fp, "%d %lu %lu %lu %lu %lu %lu %lu %lu %s\n", 
+      fprintf(fp, "%d %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu %s\n", 
         measure.churn_cycle,  
         (measure.end_ts- test_begin).count(),  // ts
         (measure.end_ts - measure.start_ts).count(),  //duration
@@ -138,6 +154,10 @@ void write_churn_thrput_by_phase_to_file(
         measure.false_deletes,
         measure.total_deletes,
         measure.total_inserts,
+        measure.false_positives,
+        measure.total_neg_lookups,
+        measure.cache_hits,
+        measure.total_cache_accesses,
         measure.operation.c_str());
   }
   fclose(fp);
@@ -183,6 +203,13 @@ void usage(char *name) {
       "  -c churn cycles       [ Number of churn cycles.  Default 10 ]\n"
       "  -l churn length       [ Number of lookup operations per churn ]\n"
       "cycle ]\n"
+      "  -n churn length       [ Number of lookups of absent keys per churn cycle,\n"
+      "                          to measure false positives. Default 0 ]\n"
+      "  -e churn length       [ Number of cache accesses per churn cycle: a lookup,\n"
+      "                          and an insert on a miss. Keys are drawn from 2 x nslots\n"
+      "                          keys with a Zipf distribution. Needs a map that\n"
+      "                          evicts, CACHE=1 for ours. Default 0 ]\n"
+      "  -x skew               [ Zipf exponent of cache accesses, in hundredths. Default 99 ]\n"
       "  -w churn length       [ Number of insert/delete operations per churn.]\n"
       "  -r record             [ Whether to record. If 1 will record to -f. Use test_runner to replay or check test case.]\n"
       "  -f record/replay file [ File to record to. Default test_case.txt ]\n"
@@ -202,7 +229,7 @@ void parseArgs(int argc, char **argv) {
   char *term;
   int nchurn_ops;
 
-  while ((opt = getopt(argc, argv, "d:k:q:v:i:c:w:l:f:p:r:s:g:t:m:z:")) != -1) {
+  while ((opt = getopt(argc, argv, "d:k:q:v:i:c:w:l:n:e:x:f:p:r:s:g:t:m:z:")) != -1) {
     switch (opt) {
 		case 'd':
 				dir = std::string(optarg);
@@ -255,6 +282,30 @@ void parseArgs(int argc, char **argv) {
         exit(1);
       }
       break;
+    case 'n':
+      nchurn_neg_lookup_ops = strtol(optarg, &term, 10);
+      if (*term) {
+        fprintf(stderr, "Argument to -n must be an integer\n");
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'e':
+      nchurn_cache_ops = strtol(optarg, &term, 10);
+      if (*term) {
+        fprintf(stderr, "Argument to -e must be an integer\n");
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'x':
+      cache_skew = strtol(optarg, &term, 10);
+      if (*term) {
+        fprintf(stderr, "Argument to -x must be an integer\n");
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
     case 'm':
       mixed_workload = strtol(optarg, &term, 10);
       if (*term) {
@@ -332,6 +383,12 @@ void parseArgs(int argc, char **argv) {
     printf("Recording to : %s\n", record_file.c_str());
   }
 
+#ifdef QF_FILTER
+  // The filter hashes keys down to key_bits, so draw them from 64 bits.
+  key_universe_bits = 64;
+#else
+  key_universe_bits = key_bits;
+#endif
   num_slots = (1ULL << quotient_bits);
   num_initial_load_keys = ((1ULL << quotient_bits) * initial_load_factor / 100);
   false_lookups = 0;
@@ -339,6 +396,27 @@ void parseArgs(int argc, char **argv) {
   total_lookups = 0;
   total_deletes = 0;
   total_inserts = 0;
+  false_positives = 0;
+  total_neg_lookups = 0;
+  cache_hits = 0;
+  total_cache_accesses = 0;
+}
+
+/* Draw the keys cache accesses pick from, and their Zipf CDF. */
+void generate_cache_keys() {
+  uint64_t nkeys = 2 * num_slots;
+  cache_keys.resize(nkeys);
+  RAND_bytes((unsigned char *)cache_keys.data(), nkeys * sizeof(uint64_t));
+  for (auto &key : cache_keys)
+    key &= BITMASK(key_universe_bits);
+  cache_key_cdf.resize(nkeys);
+  double sum = 0;
+  for (uint64_t i = 0; i < nkeys; i++) {
+    sum += 1.0 / pow(i + 1, cache_skew / 100.0);
+    cache_key_cdf[i] = sum;
+  }
+  for (auto &p : cache_key_cdf)
+    p /= sum;
 }
 
 void generate_load_ops(
@@ -358,7 +436,7 @@ void generate_load_ops(
   RAND_bytes((unsigned char *)values,
              num_initial_load_ops * sizeof(num_initial_load_ops));
   for (uint64_t i = 0; i < num_initial_load_ops; i++) {
-    uint64_t key = (keys[i] & BITMASK(key_bits));
+    uint64_t key = (keys[i] & BITMASK(key_universe_bits));
     uint64_t value = (values[i] & BITMASK(value_bits));
     kv.push_back(std::make_pair(key, value));
     ops.push_back(hm_op{INSERT, key, value});
@@ -403,7 +481,7 @@ std::vector<hm_op> generate_churn_ops(
           // So do a delete here instead.
           op_choice = DELETE;
         } else {
-          uint64_t key = (new_keys[num_ops[INSERT]] & BITMASK(key_bits));
+          uint64_t key = (new_keys[num_ops[INSERT]] & BITMASK(key_universe_bits));
           uint64_t value = (new_values[num_ops[INSERT]] & BITMASK(value_bits));
           ops.push_back(hm_op{INSERT, key, value});
           // Insert the key into a slot that was just deleted.
@@ -442,7 +520,7 @@ std::vector<hm_op> generate_churn_ops(
     for (int churn_op = 0; churn_op < nchurn_insert_ops; churn_op++) {
       uint32_t index = keys_indexes_to_delete[churn_op] % kv.size();
 
-      uint64_t key = (new_keys[churn_op] & BITMASK(key_bits));
+      uint64_t key = (new_keys[churn_op] & BITMASK(key_universe_bits));
       uint64_t value = (new_values[churn_op] & BITMASK(value_bits));
       ops.push_back(hm_op{INSERT, key, value});
       // Insert the key into the slot that was just deleted.
@@ -455,6 +533,34 @@ std::vector<hm_op> generate_churn_ops(
       ops.push_back(hm_op{LOOKUP, key, value});
     }
   }
+  if (nchurn_neg_lookup_ops) {
+    // Draw keys that are not in the map, after this cycle's inserts.
+    std::unordered_set<uint64_t> present;
+    for (auto &p : kv)
+      present.insert(p.first);
+    uint64_t key;
+    for (int churn_op = 0; churn_op < nchurn_neg_lookup_ops; churn_op++) {
+      do {
+        RAND_bytes((unsigned char *)&key, sizeof(key));
+        key &= BITMASK(key_universe_bits);
+      } while (present.count(key));
+      ops.push_back(hm_op{NEG_LOOKUP, key, 0});
+    }
+  }
+  if (nchurn_cache_ops) {
+    std::vector<uint64_t> draws(nchurn_cache_ops);
+    RAND_bytes((unsigned char *)draws.data(),
+               nchurn_cache_ops * sizeof(uint64_t));
+    for (int churn_op = 0; churn_op < nchurn_cache_ops; churn_op++) {
+      double p = ldexp((double)(draws[churn_op] >> 11), -53);
+      uint64_t rank = std::lower_bound(cache_key_cdf.begin(),
+                                       cache_key_cdf.end(), p) -
+                      cache_key_cdf.begin();
+      rank = std::min<uint64_t>(rank, cache_keys.size() - 1);
+      uint64_t key = cache_keys[rank];
+      ops.push_back(hm_op{CACHE_ACCESS, key, key & BITMASK(value_bits)});
+    }
+  }
   delete keys_indexes_to_delete;
   delete keys_indexes_to_query;
   delete new_keys;
@@ -482,6 +588,20 @@ inline int execute_hm_op(
       ret = g_remove(ops[op_index].key);
       if (ret) false_deletes++;
       break;
+    case NEG_LOOKUP:
+      total_neg_lookups++;
+      ret = g_lookup(ops[op_index].key, &lookup_value);
+      if (ret == 0) false_positives++;
+      break;
+    case CACHE_ACCESS:
+      total_cache_accesses++;
+      ret = g_lookup(ops[op_index].key, &lookup_value);
+      if (ret == 0) {
+        cache_hits++;
+        break;
+      }
+      ret = g_insert(ops[op_index].key, ops[op_index].value);
+      break;
   }
   return ret;
 }
@@ -512,7 +632,14 @@ int profile_ops(
             throughput_measure_end,
             throughput_bucket_size,
             false_lookups,
-            false_deletes
+            false_deletes,
+            total_lookups,
+            total_deletes,
+            total_inserts,
+            false_positives,
+            total_neg_lookups,
+            cache_hits,
+            total_cache_accesses
           });
       }
       throughput_measure_begin = high_resolution_clock::now();
@@ -547,7 +674,11 @@ int profile_ops(
       false_deletes,
       total_lookups,
       total_deletes,
-      total_inserts
+      total_inserts,
+      false_positives,
+      total_neg_lookups,
+      cache_hits,
+      total_cache_accesses
     });
   }
   return 0;
@@ -603,6 +734,20 @@ void run_churn(
       if (status) break;
       churn_start_op += nchurn_lookup_ops;
     }
+    if (nchurn_neg_lookup_ops) {
+      // NEG_LOOKUP
+      throughput_ops_per_bucket = std::max(1, nchurn_neg_lookup_ops / churn_thrput_resolution);
+      status = profile_ops(i, "NEG_LOOKUP", thrput_measures, latency_measures, ops, churn_start_op, churn_start_op+ nchurn_neg_lookup_ops, throughput_ops_per_bucket, should_measure_latency);
+      if (status) break;
+      churn_start_op += nchurn_neg_lookup_ops;
+    }
+    if (nchurn_cache_ops) {
+      // CACHE
+      throughput_ops_per_bucket = std::max(1, nchurn_cache_ops / churn_thrput_resolution);
+      status = profile_ops(i, "CACHE", thrput_measures, latency_measures, ops, churn_start_op, churn_start_op+ nchurn_cache_ops, throughput_ops_per_bucket, should_measure_latency);
+      if (status) break;
+      churn_start_op += nchurn_cache_ops;
+    }
 
 
     // Flush logs
@@ -619,6 +764,14 @@ void run_churn(
   write_churn_thrput_by_phase_to_file(thrput_measures, test_begin, false, thrput_output_file);
   write_churn_latency_by_phase_to_file(latency_measures, false, latency_output_file);
   write_churn_metadata_to_file(metadata_measures, test_begin, false, metadata_output_file);
+  if (total_neg_lookups)
+    printf("false positive rate: %f (%lu/%lu)\n",
+           1.0 * false_positives / total_neg_lookups, false_positives,
+           total_neg_lookups);
+  if (total_cache_accesses)
+    printf("cache hit rate: %f (%lu/%lu)\n",
+           1.0 * cache_hits / total_cache_accesses, cache_hits,
+           total_cache_accesses);
 }
 
 void run_load(std::vector<hm_op> &ops, uint64_t num_initial_load_keys, size_t npoints, std::string output_file) {
@@ -675,6 +828,8 @@ void churn_test() {
   std::vector<hm_op> ops;
   std::vector<std::pair<uint64_t, uint64_t>> kv;
   generate_load_ops(ops, kv);
+  if (nchurn_cache_ops)
+    generate_cache_keys();
 
   g_init(num_slots, key_bits, value_bits, max_load_factor);
   // LOAD PHASE.
@@ -6,6 +6,9 @@
 #include <time.h>
 #include <iostream>
 #include <chrono>
+#include <atomic>
+#include <thread>
+#include <vector>
 
 using namespace std;
 using namespace std::chrono;
@@ -19,6 +22,24 @@ uint64_t ncommon_keys = 20000;
 uint64_t key_size = 64;
 uint64_t log_slots = 27;
 uint64_t nslots = (1ULL << log_slots);
+uint32_t max_threads = std::thread::hardware_concurrency();
+// The results only hold the common keys and a few false matches.
+uint64_t result_log_slots = 16;
+uint64_t result_slots = (1ULL << result_log_slots);
+
+// Streaming join plus aggregate: each thread sums the values of the common
+// keys it is handed, nothing is materialized.
+struct alignas(64) join_sum {
+  uint64_t sum;
+};
+
+void sum_matches(const uint64_t *keys, const uint64_t *values_a,
+                 const uint64_t *values_b, size_t n, uint32_t thread,
+                 void *arg) {
+  join_sum *sums = (join_sum *)arg;
+  for (size_t i = 0; i < n; i++)
+    sums[thread].sum += values_a[i] + values_b[i];
+}
 
 HM zomb1;
 HM zomb2;
@@ -44,10 +65,8 @@ void join_test() {
   // Initialize GZHM, ICEBERG
   iceberg_init(&ice1, log_slots);
   iceberg_init(&ice2, log_slots);
-  iceberg_init(&ice3_result, log_slots);
   hm_malloc(&zomb1, nslots, key_size, 0 /* value_size */, QF_HASH_NONE, 0, load_factor);
   hm_malloc(&zomb2, nslots, key_size, 0 /* value_size */, QF_HASH_NONE, 0, load_factor);
-  hm_malloc(&zomb_result, nslots, key_size, 0 /* value_size */, QF_HASH_NONE, 0, load_factor);
 
   // Fill up GZHM and ICEBERG
   for (uint64_t i=0; i < num_keys; i++) {
@@ -64,45 +83,80 @@ void join_test() {
     iceberg_insert(&ice2, common_keys[i], 0, 0);
   }
 
-	// TODO: Time this
-  time_point<high_resolution_clock> qf_join_begin, qf_join_end;
-  qf_join_begin = high_resolution_clock::now();
-	qf_join(&zomb1, &zomb2, &zomb_result);
-  qf_join_end = high_resolution_clock::now();
-  auto qf_join_duration = std::chrono::duration_cast<std::chrono::nanoseconds>(qf_join_end - qf_join_begin);
-  std::cout<<qf_join_duration.count()<<std::endl;
-
-  time_point<high_resolution_clock> ice_join_begin, ice_join_end;
-  ice_join_begin = high_resolution_clock::now();
-  uint64_t value;
-  uint64_t count = 0;
-  for (uint64_t i=0; i < num_keys; i++) {
-    if (iceberg_get_value(&ice2, key_set_1[i], &value, 0)) {
-      iceberg_insert(&ice3_result, key_set_1[i], value, 0);
-      count++;
-    }
-  }
-  for (uint64_t i=0; i < ncommon_keys; i++) {
-    if (iceberg_get_value(&ice2, common_keys[i], &value, 0)) {
-      iceberg_insert(&ice3_result, common_keys[i], value, 0);
-      count++;
-    }
+  for (uint32_t nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+    hm_malloc(&zomb_result, result_slots, key_size, 0 /* value_size */,
+              QF_HASH_NONE, 0, load_factor);
+    time_point<high_resolution_clock> qf_join_begin, qf_join_end;
+    qf_join_begin = high_resolution_clock::now();
+    int64_t qf_count = qf_join_parallel(&zomb1, &zomb2, &zomb_result, nthreads);
+    qf_join_end = high_resolution_clock::now();
+    auto qf_join_duration = duration_cast<nanoseconds>(qf_join_end - qf_join_begin);
+    hm_free(&zomb_result);
+
+    std::vector<join_sum> sums(nthreads);
+    time_point<high_resolution_clock> stream_begin, stream_end;
+    stream_begin = high_resolution_clock::now();
+    int64_t stream_count =
+        qf_join_stream(&zomb1, &zomb2, nthreads, sum_matches, sums.data());
+    stream_end = high_resolution_clock::now();
+    auto stream_duration = duration_cast<nanoseconds>(stream_end - stream_begin);
+
+    // Probe join: look up the keys of the first table in the second one.
+    iceberg_init(&ice3_result, result_log_slots);
+    std::atomic<uint64_t> ice_count(0);
+    auto probe = [&](uint32_t tid) {
+      uint64_t value, count = 0;
+      for (uint64_t i = tid; i < num_keys; i += nthreads) {
+        if (iceberg_get_value(&ice2, key_set_1[i], &value, tid)) {
+          iceberg_insert(&ice3_result, key_set_1[i], value, tid);
+          count++;
+        }
+      }
+      for (uint64_t i = tid; i < ncommon_keys; i += nthreads) {
+        if (iceberg_get_value(&ice2, common_keys[i], &value, tid)) {
+          iceberg_insert(&ice3_result, common_keys[i], value, tid);
+          count++;
+        }
+      }
+      ice_count += count;
+    };
+    time_point<high_resolution_clock> ice_join_begin, ice_join_end;
+    ice_join_begin = high_resolution_clock::now();
+    std::vector<std::thread> threads;
+    for (uint32_t t = 1; t < nthreads; t++)
+      threads.emplace_back(probe, t);
+    probe(0);
+    for (auto &thread : threads)
+      thread.join();
+    ice_join_end = high_resolution_clock::now();
+    auto ice_join_duration = duration_cast<nanoseconds>(ice_join_end - ice_join_begin);
+
+    printf("threads: %u GZHM ms: %.2f common keys: %ld GZHM stream ms: %.2f "
+           "common keys: %ld ICEBERG ms: %.2f common keys: %ld\n",
+           nthreads, qf_join_duration.count() / 1e6, qf_count,
+           stream_duration.count() / 1e6, stream_count,
+           ice_join_duration.count() / 1e6, ice_count.load());
   }
-  ice_join_end = high_resolution_clock::now();
-  auto ice_join_duration = std::chrono::duration_cast<std::chrono::nanoseconds>(ice_join_end - ice_join_begin);
-  std::cout<<ice_join_duration.count()<<std::endl;
-    printf("Ice CommonKeys: %ld\n", count);
-
-  delete key_set_1;
-  delete key_set_2;
-  delete common_keys;
+
+  delete[] key_set_1;
+  delete[] key_set_2;
+  delete[] common_keys;
   // Delete iceberg?
   // Delete gzhm.
 
 }
 
 
+// Usage: join_test [log_slots] [max_threads]
 int main(int argc, char **argv) {
+  if (argc > 1) {
+    log_slots = atoll(argv[1]);
+    nslots = 1ULL << log_slots;
+  }
+  if (argc > 2)
+    max_threads = atoi(argv[2]);
+  if (max_threads == 0)
+    max_threads = 1;
   join_test();
   return 0;
 }
@@ -1,18 +1,18 @@
 # First flag is input level.
 if [ $1 -eq 0 ]; then
-  run_args="-k 16 -q 8 -v 0 -w 10 -l 200 -i 95 -s 0 -t 1 -g 50"
+  run_args="-k 16 -q 8 -v 0 -w 10 -l 200 -s 0 -t 1 -g 50"
   qf_bits_per_slot="-DQF_BITS_PER_SLOT=8"
 elif [ $1 -eq 1 ]; then
-  run_args="-k 38 -q 22 -v 0 -w 41943 -l 838860 -i 95 -s 0 -t 1 -g 50"
+  run_args="-k 38 -q 22 -v 0 -w 41943 -l 838860 -s 0 -t 1 -g 50"
   qf_bits_per_slot="-DQF_BITS_PER_SLOT=16"
 elif [ $1 -eq 2 ]; then
-  run_args="-k 59 -q 27 -v 0 -w 1342100 -l 26843500 -i 95 -s 0 -t 1 -g 50"
+  run_args="-k 59 -q 27 -v 0 -w 1342100 -l 26843500 -s 0 -t 1 -g 50"
   qf_bits_per_slot="-DQF_BITS_PER_SLOT=32"
 elif [ $1 -eq 3 ]; then
-  run_args="-k 64 -q 27 -v 0 -w 1342100 -l 26843500 -i 95 -s 0 -t 1 -g 50"
+  run_args="-k 64 -q 27 -v 0 -w 1342100 -l 26843500 -s 0 -t 1 -g 50"
   qf_bits_per_slot=
 elif [ $1 -eq 4 ]; then
-  run_args="-k 64 -q 27 -v 0 -w 1342100 -l 26843500 -i 95 -s 0 -t 1 -g 50"
+  run_args="-k 64 -q 27 -v 0 -w 1342100 -l 26843500 -s 0 -t 1 -g 50"
   qf_bits_per_slot=64
 else 
   echo "Specify input data level"
@@ -32,6 +32,12 @@ else
 fi
 
 VARIANTS=($3)
+# Optional fourth flag is a list of load factors, fifth is a list of
+# QF_BLOCK_OFFSET_BITS values (log2 slots per block), sixth is QF_OFFSET_BITS.
+# Swept values are appended to the build and run directory names.
+LOAD_LIST=(${4:-95})
+BLOCK_BITS_LIST=(${5:-6})
+offset_bits=${6:+-DQF_OFFSET_BITS=$6}
 
 out_dir="sponge/gzhm_variants${latency}_$1"
 build_dir=${out_dir}/build
@@ -43,17 +49,26 @@ mkdir -p ${run_dir}
 mkdir -p ${result_dir}
 
 for VARIANT in "${VARIANTS[@]}"; do
-  mkdir -p ${build_dir}/$VARIANT
-  cmake . -B${build_dir}/$VARIANT -DCMAKE_BUILD_TYPE=Release -DVARIANT=$VARIANT
-  cmake --build ${build_dir}/$VARIANT -j8
+for BLOCK_BITS in "${BLOCK_BITS_LIST[@]}"; do
+  build=${build_dir}/${VARIANT}${5:+_$BLOCK_BITS}
+  mkdir -p ${build}
+  cmake . -B${build} -DCMAKE_BUILD_TYPE=Release -DVARIANT=$VARIANT -DQF_BLOCK_OFFSET_BITS=$BLOCK_BITS ${offset_bits}
+  cmake --build ${build} -j8
+done
 done
 
 for VARIANT in "${VARIANTS[@]}"; do
-  rm -rf ${run_dir}/$VARIANT
-  rm -rf ${result_dir}/$VARIANT
-  mkdir -p ${run_dir}/$VARIANT
-  echo ./${build_dir}/$VARIANT/hm_churn ${run_args} ${churn_args} -d ${run_dir}/$VARIANT/
-  numactl -N 0 -m 0 ./${build_dir}/$VARIANT/hm_churn $run_args $churn_args -d ${run_dir}/$VARIANT/
+rm -rf ${result_dir}/$VARIANT
+for BLOCK_BITS in "${BLOCK_BITS_LIST[@]}"; do
+for LOAD in "${LOAD_LIST[@]}"; do
+  build=${build_dir}/${VARIANT}${5:+_$BLOCK_BITS}
+  run=${run_dir}/${VARIANT}${5:+_$BLOCK_BITS}${4:+_$LOAD}
+  rm -rf ${run}
+  mkdir -p ${run}
+  echo ./${build}/hm_churn ${run_args} -i ${LOAD} ${churn_args} -d ${run}/
+  numactl -N 0 -m 0 ./${build}/hm_churn $run_args -i ${LOAD} $churn_args -d ${run}/
+done
+done
 done
 
 echo python3 ./bench/plot_graph.py ${run_dir} ${result_dir}
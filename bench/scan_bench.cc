@@ -0,0 +1,214 @@
+#include <openssl/rand.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "hm.h"
+#include "gqf_int.h"
+
+using namespace std::chrono;
+
+// Throughput of a full QFi scan, item by item and with qfi_next_batch, on a
+// freshly filled table and again after heavy churn has left tombstones
+// between the items. Then extraction of hash partitions, as when resharding,
+// with hm_scan_range against a loop of point lookups, and table statistics
+// (sum and histogram of the values) with hm_parallel_reduce.
+// Usage: scan_bench [log_slots] [churn rounds, in multiples of nslots]
+//                   [max_threads]
+
+uint64_t log_slots = 22;
+uint64_t nslots = (1ULL << log_slots);
+uint64_t churn_rounds = 4;
+uint32_t max_threads = std::thread::hardware_concurrency();
+float load_factor = 0.85;
+const int nscans = 5;
+const size_t batch_size = 1024;
+const uint64_t key_bits = 40;
+const uint64_t partition_bits = 4;
+
+HM hm;
+
+void scan_test(const char *phase) {
+  uint64_t nitems = 0, key, value, sum = 0;
+  time_point<high_resolution_clock> begin, end;
+  begin = high_resolution_clock::now();
+  for (int s = 0; s < nscans; s++) {
+    QFi qfi;
+    nitems = 0;
+    for (qf_iterator_from_position(&hm, &qfi, 0); !qfi_end(&qfi);
+         qfi_next(&qfi)) {
+      qfi_get_hash(&qfi, &key, &value);
+      sum += key;
+      nitems++;
+    }
+  }
+  end = high_resolution_clock::now();
+  auto duration = duration_cast<nanoseconds>(end - begin);
+  const double ns = (double)duration.count() / nscans;
+  printf("%s: items: %ld nelts: %ld occupied slots: %ld Mitems/s: %.2f "
+         "ns/item: %.2f (%lx)\n",
+         phase, nitems, hm.metadata->nelts, hm.metadata->noccupied_slots,
+         nitems * 1e3 / ns, ns / nitems, sum & 0xff);
+  if (nitems != hm.metadata->nelts)
+    fprintf(stderr, "%s: scanned %ld items, expected %ld.\n", phase, nitems,
+            hm.metadata->nelts);
+
+  uint64_t hashes[batch_size], values[batch_size], batch_sum = 0;
+  begin = high_resolution_clock::now();
+  for (int s = 0; s < nscans; s++) {
+    QFi qfi;
+    size_t n;
+    nitems = 0;
+    qf_iterator_from_position(&hm, &qfi, 0);
+    while ((n = qfi_next_batch(&qfi, hashes, values, batch_size)) > 0) {
+      for (size_t i = 0; i < n; i++)
+        batch_sum += hashes[i];
+      nitems += n;
+    }
+  }
+  end = high_resolution_clock::now();
+  duration = duration_cast<nanoseconds>(end - begin);
+  const double batch_ns = (double)duration.count() / nscans;
+  printf("%s batch: items: %ld Mitems/s: %.2f ns/item: %.2f\n", phase, nitems,
+         nitems * 1e3 / batch_ns, batch_ns / nitems);
+  if (nitems != hm.metadata->nelts || batch_sum != sum)
+    fprintf(stderr, "%s: batch scan doesn't match the item scan.\n", phase);
+}
+
+void count_items(const uint64_t *keys, const uint64_t *values, size_t n,
+                 void *arg) {
+  *(uint64_t *)arg += n;
+}
+
+void partition_test(const uint64_t *keys, uint64_t nkeys) {
+  const uint64_t npartitions = 1ULL << partition_bits;
+  const uint64_t partition_shift = key_bits - partition_bits;
+  const uint64_t key_mask = (1ULL << key_bits) - 1;
+  // The lookup loop needs the keys of each partition at hand.
+  std::vector<std::vector<uint64_t>> partition_keys(npartitions);
+  for (uint64_t i = 0; i < nkeys; i++)
+    partition_keys[(keys[i] & key_mask) >> partition_shift].push_back(keys[i]);
+
+  uint64_t nitems = 0;
+  time_point<high_resolution_clock> begin, end;
+  begin = high_resolution_clock::now();
+  for (uint64_t p = 0; p < npartitions; p++)
+    hm_scan_range(&hm, p << partition_shift, (p + 1) << partition_shift,
+                  count_items, &nitems);
+  end = high_resolution_clock::now();
+  const double scan_ns = duration_cast<nanoseconds>(end - begin).count();
+
+  uint64_t nfound = 0, value;
+  begin = high_resolution_clock::now();
+  for (uint64_t p = 0; p < npartitions; p++)
+    for (uint64_t key : partition_keys[p])
+      nfound += hm_lookup(&hm, key, &value, QF_NO_LOCK | QF_KEY_IS_HASH) >= 0;
+  end = high_resolution_clock::now();
+  const double lookup_ns = duration_cast<nanoseconds>(end - begin).count();
+
+  printf("partitions: %ld range scan ms: %.2f items: %ld lookups ms: %.2f "
+         "items: %ld\n",
+         npartitions, scan_ns / 1e6, nitems, lookup_ns / 1e6, nfound);
+  if (nitems != hm.metadata->nelts)
+    fprintf(stderr, "partitions: scanned %ld items, expected %ld.\n", nitems,
+            hm.metadata->nelts);
+}
+
+// Sum of the values and histogram of their low bits.
+struct value_stats {
+  uint64_t sum;
+  uint64_t histogram[16];
+};
+
+void reduce_stats(void *partial, const uint64_t *keys, const uint64_t *values,
+                  size_t n, void *arg) {
+  value_stats *stats = (value_stats *)partial;
+  for (size_t i = 0; i < n; i++) {
+    stats->sum += values[i];
+    stats->histogram[values[i] & 15]++;
+  }
+}
+
+void combine_stats(void *result, const void *partial, void *arg) {
+  value_stats *stats = (value_stats *)result;
+  const value_stats *other = (const value_stats *)partial;
+  stats->sum += other->sum;
+  for (int i = 0; i < 16; i++)
+    stats->histogram[i] += other->histogram[i];
+}
+
+void reduce_test(const char *phase) {
+  value_stats expected = {};
+  uint64_t key, value;
+  QFi qfi;
+  auto begin = high_resolution_clock::now();
+  for (qf_iterator_from_position(&hm, &qfi, 0); !qfi_end(&qfi);
+       qfi_next(&qfi)) {
+    qfi_get_hash(&qfi, &key, &value);
+    reduce_stats(&expected, &key, &value, 1, nullptr);
+  }
+  auto end = high_resolution_clock::now();
+  printf("%s stats: QFi ms: %.2f", phase,
+         duration_cast<nanoseconds>(end - begin).count() / 1e6);
+
+  for (uint32_t nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+    value_stats stats = {};
+    begin = high_resolution_clock::now();
+    hm_parallel_reduce(&hm, nthreads, &stats, sizeof(stats), reduce_stats,
+                       combine_stats, nullptr);
+    end = high_resolution_clock::now();
+    printf(" threads %u ms: %.2f", nthreads,
+           duration_cast<nanoseconds>(end - begin).count() / 1e6);
+    if (memcmp(&stats, &expected, sizeof(stats)) != 0)
+      fprintf(stderr, "%s: parallel stats don't match the scan.\n", phase);
+  }
+  printf("\n");
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1) {
+    log_slots = atoll(argv[1]);
+    nslots = 1ULL << log_slots;
+  }
+  if (argc > 2)
+    churn_rounds = atoll(argv[2]);
+  if (argc > 3)
+    max_threads = atoi(argv[3]);
+  if (max_threads == 0)
+    max_threads = 1;
+  hm_malloc(&hm, nslots, key_bits, 8 /* value_bits */, QF_HASH_NONE, 0, 0.95);
+
+  const uint64_t nkeys = load_factor * nslots;
+  uint64_t *keys = new uint64_t[nkeys];
+  RAND_bytes((unsigned char *)keys, nkeys * sizeof(uint64_t));
+  for (uint64_t i = 0; i < nkeys; i++)
+    hm_insert(&hm, keys[i], i & 0xff, QF_NO_LOCK | QF_KEY_IS_HASH);
+  scan_test("fresh");
+  partition_test(keys, nkeys);
+  reduce_test("fresh");
+
+  // Replace a random key by a new one, nslots times per round.
+  const uint64_t nchurn = churn_rounds * nslots;
+  uint64_t *victims = new uint64_t[nchurn];
+  uint64_t *new_keys = new uint64_t[nchurn];
+  RAND_bytes((unsigned char *)victims, nchurn * sizeof(uint64_t));
+  RAND_bytes((unsigned char *)new_keys, nchurn * sizeof(uint64_t));
+  for (uint64_t i = 0; i < nchurn; i++) {
+    uint64_t &k = keys[victims[i] % nkeys];
+    if (hm_remove(&hm, k, QF_NO_LOCK | QF_KEY_IS_HASH) < 0)
+      continue;
+    if (hm_insert(&hm, new_keys[i], i & 0xff, QF_NO_LOCK | QF_KEY_IS_HASH) >= 0)
+      k = new_keys[i];
+  }
+  scan_test("churned");
+  reduce_test("churned");
+
+  delete[] keys;
+  delete[] victims;
+  delete[] new_keys;
+  hm_free(&hm);
+  return 0;
+}
@@ -0,0 +1,63 @@
+#include <openssl/rand.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+
+#include "hm.h"
+#include "gqf_int.h"
+#include "ts_util.h"
+
+using namespace std::chrono;
+
+// Latency of shift_runends_tombstones over 1, 4 and 16 block shifts.
+// Build with and without SCALAR_SHIFT (CMake) to compare against the scalar
+// loop.
+
+uint64_t log_slots = 20;
+uint64_t nslots = (1ULL << log_slots);
+uint64_t nshifts = 1000000;
+
+HM hm;
+
+#ifdef QF_TOMBSTONE
+void shift_test(uint64_t nblocks_shifted) {
+  const uint64_t span = nblocks_shifted * QF_SLOTS_PER_BLOCK;
+  const uint64_t nstarts = nslots - span - QF_SLOTS_PER_BLOCK;
+  uint64_t *starts = new uint64_t[nshifts];
+  RAND_bytes((unsigned char *)starts, nshifts * sizeof(uint64_t));
+  for (uint64_t i = 0; i < nshifts; i++)
+    starts[i] %= nstarts;
+
+  time_point<high_resolution_clock> begin, end;
+  begin = high_resolution_clock::now();
+  for (uint64_t i = 0; i < nshifts; i++)
+    shift_runends_tombstones(&hm, starts[i], starts[i] + span - 1, 1);
+  end = high_resolution_clock::now();
+  auto duration = duration_cast<nanoseconds>(end - begin);
+  printf("blocks: %ld ns/shift: %.2f\n", nblocks_shifted,
+         (double)duration.count() / nshifts);
+  delete[] starts;
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1)
+    nshifts = atoll(argv[1]);
+  hm_malloc(&hm, nslots, 64 /* key_bits */, 0 /* value_bits */, QF_HASH_NONE,
+            0, 0.95);
+  // Random metadata, the shift doesn't look at what the bits mean.
+  for (uint64_t b = 0; b < hm.metadata->nblocks; b++) {
+    qfblock *block = get_block(&hm, b);
+    RAND_bytes((unsigned char *)block->runends, sizeof(block->runends));
+    RAND_bytes((unsigned char *)block->tombstones, sizeof(block->tombstones));
+  }
+  shift_test(1);
+  shift_test(4);
+  shift_test(16);
+  return 0;
+}
+#else
+int main(int argc, char **argv) {
+  fprintf(stderr, "shift_bench needs a variant with tombstones.\n");
+  return 1;
+}
+#endif
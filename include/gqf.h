@@ -3,6 +3,7 @@
 
 #include <inttypes.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -17,7 +18,8 @@ extern "C" {
        this can be useful when inserting large keys that need to be
        hashed down to a small fingerprint.  With this type of hash,
        you can iterate over the hash values of all the keys in the
-       CQF, but you cannot iterate over the keys themselves.
+       CQF, but you cannot iterate over the keys themselves.  The
+       hash is MurmurHash64A, seeded with "seed".
 
 		 - INVERTIBLE has no false positives, but the size of the hash
        output must be the same as the size of the hash input,
@@ -31,9 +33,12 @@ extern "C" {
 			 distribution of intputs.
 	*/
 	
+	/* DEFAULT is last so INVERTIBLE and NONE keep the values that files
+		 written before it was added store in their metadata. */
 	enum qf_hashmode {
 		QF_HASH_INVERTIBLE,
-		QF_HASH_NONE
+		QF_HASH_NONE,
+		QF_HASH_DEFAULT
 	};
 
 	/* The CQF supports concurrent insertions and queries.  Only the
@@ -104,9 +109,11 @@ extern "C" {
 #define QF_COULDNT_LOCK (-2)
 #define QF_DOESNT_EXIST (-3)
 #define QF_KEY_EXISTS (-4)
+#define QF_VALUE_MISMATCH (-6)
 	
 	/* Return the number of times key has been inserted, with the given
-		 value, into qf.
+		 value, into qf. Keys are unique, so this is 0 or 1; counting maps
+		 keep their counters in the value, see hm_count().
 		 May return QF_COULDNT_LOCK if called with QF_TRY_LOCK.  */
 	uint64_t qf_count_key_value(const QF *qf, uint64_t key, uint64_t value,
 															uint8_t flags);
@@ -137,6 +144,9 @@ extern "C" {
 	typedef struct quotient_filter_iterator quotient_filter_iterator;
 	typedef quotient_filter_iterator QFi;
 
+	/* Iterators only stop at live items: tombstones (and expired items under
+	 * QF_TTL) are skipped. */
+
 #define QF_INVALID (-4)
 #define QFI_INVALID (-5)
 	
@@ -177,6 +187,16 @@ extern "C" {
 	 */
 	int qfi_next(QFi *qfi);
 
+	/* Copy the hashes and values of up to `max` items, from the current one
+	 * on, to `hashes` and `values`, and advance past them. Decodes 64 slots
+	 * at a time from their metadata words, for scans that would otherwise pay
+	 * a qfi_get_hash and a qfi_next per item.
+	 * Return value:
+	 *   the number of items copied, 0 when the iterator has reached end.
+	 */
+	size_t qfi_next_batch(QFi *qfi, uint64_t *hashes, uint64_t *values,
+	                      size_t max);
+
 	/* Check to see if the if the end of the QF */
 	bool qfi_end(const QFi *qfi);
 
@@ -209,8 +229,60 @@ extern "C" {
 	void qf_dump_long(const QF *);
 	void qf_dump_metadata(const QF *qf);
 
-	// Select the common keys from qfa, qfb into qfc
-	void qf_join(const QF *qfa, const QF *qfb, QF *qfc);
+	/* Set operations. Each is one ordered pass over both inputs, the result
+	 * is inserted into qfc in hash order. The tables may have different
+	 * sizes, but must hash keys the same way: same hash mode, seed and key
+	 * bits. A key in both inputs keeps the value it has in qfa.
+	 * Return value:
+	 *   >= 0: the number of keys written to qfc.
+	 *   = QF_INVALID: the tables hash keys differently.
+	 *   = QF_NO_SPACE: qfc is full.
+	 */
+
+	// Keys in both qfa and qfb.
+	int64_t qf_join(const QF *qfa, const QF *qfb, QF *qfc);
+
+	// Keys in qfa or qfb.
+	int64_t qf_union(const QF *qfa, const QF *qfb, QF *qfc);
+
+	// Keys in qfa but not in qfb.
+	int64_t qf_difference(const QF *qfa, const QF *qfb, QF *qfc);
+
+	// Keys in exactly one of qfa and qfb.
+	int64_t qf_symdiff(const QF *qfa, const QF *qfb, QF *qfc);
+
+	enum qf_set_op {
+		QF_INTERSECTION,
+		QF_UNION,
+		QF_DIFFERENCE,
+		QF_SYMMETRIC_DIFFERENCE
+	};
+
+	// Any of the above, with the quotients split in `nthreads` ranges merged
+	// in parallel.
+	int64_t qf_merge_parallel(const QF *qfa, const QF *qfb, QF *qfc,
+	                          enum qf_set_op op, uint32_t nthreads);
+
+	int64_t qf_join_parallel(const QF *qfa, const QF *qfb, QF *qfc,
+	                         uint32_t nthreads);
+
+	/* Receives a batch of `n` common keys of a streaming join, with their
+	 * values in each table. Keys are hashes unless the tables are
+	 * QF_HASH_INVERTIBLE, as with qfi_get_key. `thread` is the index of the
+	 * calling thread, below the `nthreads` of the join. */
+	typedef void (*qf_join_callback)(const uint64_t *keys,
+	                                 const uint64_t *values_a,
+	                                 const uint64_t *values_b, size_t n,
+	                                 uint32_t thread, void *arg);
+
+	/* Join qfa and qfb without building a result table: the common keys are
+	 * passed to `callback` in batches, in hash order within each thread.
+	 * With `nthreads` > 1 the callback runs concurrently, each thread on its
+	 * own quotient range.
+	 * Return the number of common keys, or QF_INVALID if the tables hash keys
+	 * differently. */
+	int64_t qf_join_stream(const QF *qfa, const QF *qfb, uint32_t nthreads,
+	                       qf_join_callback callback, void *arg);
 
 
 #ifdef __cplusplus
@@ -20,18 +20,100 @@ extern "C" {
 */
 // #define QF_BITS_PER_SLOT 0
 
-/* Must be >= 6.  6 seems fastest. */
+/* Must be >= 6.  6 seems fastest. Bigger blocks keep several 64-bit
+ * metadata words per block and need the new block offset. */
+#ifndef QF_BLOCK_OFFSET_BITS
 #define QF_BLOCK_OFFSET_BITS (6)
+#endif
+#if QF_BLOCK_OFFSET_BITS < 6
+#error "QF_BLOCK_OFFSET_BITS must be >= 6"
+#endif
+#if QF_BLOCK_OFFSET_BITS > 6 && !defined(_BLOCKOFFSET_4_NUM_RUNENDS)
+#error "QF_BLOCK_OFFSET_BITS > 6 needs _BLOCKOFFSET_4_NUM_RUNENDS"
+#endif
 
 #define QF_SLOTS_PER_BLOCK (1ULL << QF_BLOCK_OFFSET_BITS)
 #define QF_METADATA_WORDS_PER_BLOCK ((QF_SLOTS_PER_BLOCK + 63) / 64)
 
 #define QF_WITH_TOMBSTONE 0
 
+/* Width of qfblock::offset: 8, 16 or 32. An offset that doesn't fit is stored
+ * as QF_MAX_OFFSET and recomputed on use, which gets slow at 98-99% load
+ * where long runs spill over many blocks. Wider offsets avoid that. */
+#ifndef QF_OFFSET_BITS
+#define QF_OFFSET_BITS 8
+#endif
+#if QF_OFFSET_BITS == 8
+	typedef uint8_t qfoffset;
+#elif QF_OFFSET_BITS == 16
+	typedef uint16_t qfoffset;
+#elif QF_OFFSET_BITS == 32
+	typedef uint32_t qfoffset;
+#else
+#error "QF_OFFSET_BITS must be 8, 16 or 32"
+#endif
+#define QF_MAX_OFFSET ((1ULL << QF_OFFSET_BITS) - 1)
+
+/* Block summaries keep one bit per block recording whether the block has a
+ * runend (resp. a tombstone), so long stretches of blocks can be skipped with
+ * a single tzcnt. They are only maintained by the tombstone code paths. */
+#if defined(QF_BLOCK_SUMMARY) && !defined(QF_TOMBSTONE)
+#undef QF_BLOCK_SUMMARY
+#endif
+#define QF_SUMMARY_WORDS(nblocks) (((nblocks) + 63) / 64)
+
+/* In circular mode the table has exactly nslots slots and runs wrap around
+ * from the last block to block 0. Slot indexes past the end of the table
+ * keep growing and are mapped back onto the blocks by get_block. */
+#ifdef QF_CIRCULAR
+#if !defined(QF_TOMBSTONE) || !defined(_BLOCKOFFSET_4_NUM_RUNENDS)
+#error "QF_CIRCULAR needs QF_TOMBSTONE and _BLOCKOFFSET_4_NUM_RUNENDS"
+#endif
+#ifdef DELETE_AND_PUSH
+#error "QF_CIRCULAR doesn't support DELETE_AND_PUSH"
+#endif
+#define QF_BLOCK_INDEX(qf, block_index)                                        \
+  ((block_index) & ((qf)->metadata->nblocks - 1))
+#else
+#define QF_BLOCK_INDEX(qf, block_index) (block_index)
+#endif
+
+/* With a value pool the value bits of a slot hold an index into an array of
+ * 64-bit values kept after the blocks. Shifts then move only remainder and
+ * index bits, however wide the values are. */
+#ifdef QF_VALUE_POOL
+#define QF_POOL_NONE (~0ULL)
+#endif
+
+/* With TTLs the top QF_TTL_BITS of the value bits of a slot hold the time,
+ * on the map's clock and modulo 2^QF_TTL_BITS, at which the item expires; 0
+ * is never. Expired items are removed by the rebuild windows, so only the
+ * tombstone variants support them. */
+#ifdef QF_TTL
+#ifndef QF_TOMBSTONE
+#error "QF_TTL needs QF_TOMBSTONE"
+#endif
+#ifndef QF_TTL_BITS
+#define QF_TTL_BITS (16)
+#endif
+#if QF_TTL_BITS < 2 || QF_TTL_BITS > 32
+#error "QF_TTL_BITS must be between 2 and 32"
+#endif
+#endif
+
+/* In cache mode the top value bit of a slot is a reference bit for clock
+ * eviction. Lookups through the cache set it, the eviction scan clears it
+ * and takes the first item it finds clear. */
+#ifdef QF_CACHE
+#define QF_CACHE_SCAN (64)		// Most items looked at per eviction.
+#endif
+
+#define QF_JOIN_BATCH (1024)		// Items qf_join reads per qfi_next_batch.
+
 	typedef struct __attribute__ ((__packed__)) qfblock {
 		/* Code works with uint16_t, uint32_t, etc, but uint8_t seems just as fast as
 		 * anything else */
-		uint8_t offset; 
+		qfoffset offset;
 		uint64_t occupieds[QF_METADATA_WORDS_PER_BLOCK];
 		uint64_t runends[QF_METADATA_WORDS_PER_BLOCK];
 		#ifdef QF_TOMBSTONE
@@ -95,6 +177,18 @@ extern "C" {
 		uint64_t nblocks;
 		uint64_t nelts;						// Without tombstones
 		uint64_t noccupied_slots; // With tombstones
+		uint64_t epoch;						// Bumped by every change that may move slots.
+		#ifdef QF_VALUE_POOL
+		uint64_t pool_value_bits;	// Width of the values in the pool.
+		uint64_t pool_free;				// First free pool entry, QF_POOL_NONE if none.
+		uint64_t pool_used;				// Pool entries ever handed out.
+		#endif
+		#ifdef QF_TTL
+		uint64_t clock;						// Current time, items expire against it.
+		#endif
+		#ifdef QF_CACHE
+		uint64_t cache_capacity;	// Items kept before inserts start evicting.
+		#endif
 		#ifdef QF_TOMBSTONE
 		uint64_t n_start_rebuild;	// n_occupied_slots to start rebuild.
 		uint64_t next_tombstone;	// Next position to put a tombstone.
@@ -111,20 +205,39 @@ extern "C" {
 	typedef struct quotient_filter {
 		qfmetadata *metadata;
 		qfblock *blocks;
+#ifdef QF_BLOCK_SUMMARY
+		// Stored in the same buffer, right after the blocks.
+		uint64_t *runend_summary;			// 1 if the block has a runend.
+		uint64_t *tombstone_summary;	// 1 if the block has a tombstone.
+#endif
+#ifdef QF_VALUE_POOL
+		// Stored at the end of the buffer, one entry per slot.
+		uint64_t *values;
+#endif
 	} quotient_filter;
 
 	typedef quotient_filter QF;
 
+	/* Where a key was found: its quotient, its slot and the range of its run,
+	 * [run_start, run_end). */
+	typedef struct quotient_filter_position {
+		uint64_t quotient;
+		uint64_t index;
+		uint64_t run_start;
+		uint64_t run_end;
+	} qfposition;
+
 #if QF_BITS_PER_SLOT > 0
   static inline qfblock * get_block(const QF *qf, uint64_t block_index)
   {
-    return &qf->blocks[block_index];
+    return &qf->blocks[QF_BLOCK_INDEX(qf, block_index)];
   }
 #else
   static inline qfblock * get_block(const QF *qf, uint64_t block_index)
   {
     return (qfblock *)(((char *)qf->blocks)
-                       + block_index * (sizeof(qfblock) + QF_SLOTS_PER_BLOCK *
+                       + QF_BLOCK_INDEX(qf, block_index) *
+                       (sizeof(qfblock) + QF_SLOTS_PER_BLOCK *
                                         qf->metadata->bits_per_slot / 8));
   }
 #endif
@@ -8,6 +8,26 @@
 uint64_t MurmurHash64B ( const void * key, int len, unsigned int seed );
 uint64_t MurmurHash64A ( const void * key, int len, unsigned int seed );
 
+/* MurmurHash64A of a single 64-bit word, same output as
+ * MurmurHash64A(&key, sizeof(key), seed) but inlined. */
+static inline uint64_t MurmurHash64A_u64(uint64_t key, unsigned int seed)
+{
+	const uint64_t m = 0xc6a4a7935bd1e995;
+	const int r = 47;
+	uint64_t h = seed ^ (sizeof(key) * m);
+
+	key *= m;
+	key ^= key >> r;
+	key *= m;
+	h ^= key;
+	h *= m;
+
+	h ^= h >> r;
+	h *= m;
+	h ^= h >> r;
+	return h;
+}
+
 uint64_t hash_64(uint64_t key, uint64_t mask);
 uint64_t hash_64i(uint64_t key, uint64_t mask);
 
@@ -15,6 +15,14 @@ extern "C" {
 typedef struct quotient_filter hashmap;
 typedef hashmap HM;
 
+/* Position of a key found by hm_find_handle, valid while `epoch` matches. */
+typedef struct hm_handle {
+  uint64_t key;
+  uint8_t flags;
+  uint64_t epoch;
+  qfposition pos;
+} hm_handle;
+
 uint64_t hm_init(HM *hm, uint64_t nslots, uint64_t key_bits,
                   uint64_t value_bits, enum qf_hashmode hash, uint32_t seed,
                   void *buffer, uint64_t buffer_len);
@@ -32,6 +40,147 @@ int hm_remove(HM *hm, uint64_t key, uint8_t flags);
 
 int hm_lookup(const QF *qf, uint64_t key, uint64_t *value, uint8_t flags);
 
+#ifdef QF_TTL
+/* Insert `key` expiring `ttl` ticks from now, 0 < ttl < 2^(QF_TTL_BITS-1).
+ * Expired items are absent and become tombstones in rebuilds.
+ * Return as hm_insert. */
+int hm_insert_ttl(HM *hm, uint64_t key, uint64_t value, uint64_t ttl,
+                  uint8_t flags);
+
+/* Move the clock to `now`. */
+void hm_set_clock(HM *hm, uint64_t now);
+#endif
+
+#ifdef QF_CACHE
+/* Insert `key`, evicting an item of its cluster by a clock scan over at most
+ * QF_CACHE_SCAN items once the map is at max_load_factor.
+ * Return as hm_insert. */
+int hm_cache_insert(HM *hm, uint64_t key, uint64_t value, uint8_t flags);
+
+/* Look up `key` and mark it recently used. Return as hm_lookup. */
+int hm_cache_lookup(HM *hm, uint64_t key, uint64_t *value, uint8_t flags);
+#endif
+
+/* Keys are hashes under QF_HASH_DEFAULT, the keys themselves otherwise. */
+typedef bool (*hm_erase_pred)(uint64_t key, uint64_t value, void *arg);
+
+/* Remove the items matching `pred` in one pass. `redistribute` starts the
+ * next rebuild windows at the first run erased from.
+ * Return the number of items removed, or an error. */
+int64_t hm_erase_if(HM *hm, hm_erase_pred pred, void *arg,
+                    bool redistribute);
+
+/* Receives `n` items; keys as for hm_erase_pred. */
+typedef void (*hm_scan_callback)(const uint64_t *keys, const uint64_t *values,
+                                 size_t n, void *arg);
+
+/* Pass the items with hashes in [lo, hi) to `callback` in batches, in hash
+ * order (quotient order under UNORDERED).
+ * Return the number of items passed. */
+int64_t hm_scan_range(const HM *hm, uint64_t lo, uint64_t hi,
+                      hm_scan_callback callback, void *arg);
+
+/* Receives `n` items on thread `thread`; keys are hashes under
+ * QF_HASH_DEFAULT, as for hm_erase_pred. */
+typedef void (*hm_for_each_callback)(const uint64_t *keys,
+                                     const uint64_t *values, size_t n,
+                                     uint32_t thread, void *arg);
+
+/* Pass every item to `callback` in batches from `nthreads` threads, each on
+ * a range of whole clusters. The map must not change meanwhile.
+ * Return the number of items passed. */
+int64_t hm_parallel_for_each(const HM *hm, uint32_t nthreads,
+                             hm_for_each_callback callback, void *arg);
+
+/* Fold `n` items into one thread's `partial`. */
+typedef void (*hm_reduce_fn)(void *partial, const uint64_t *keys,
+                             const uint64_t *values, size_t n, void *arg);
+
+/* Fold one thread's `partial` into `result`. */
+typedef void (*hm_combine_fn)(void *result, const void *partial, void *arg);
+
+/* Reduce the items into `result_size` bytes at `result`, which holds the
+ * identity of `combine` on entry.
+ * Return the number of items reduced. */
+int64_t hm_parallel_reduce(const HM *hm, uint32_t nthreads, void *result,
+                           size_t result_size, hm_reduce_fn reduce,
+                           hm_combine_fn combine, void *arg);
+
+/* Split `src` into the 2^k maps `dst`, allocated here, by the top k bits of
+ * the hash. Not for QF_HASH_INVERTIBLE, QF_CIRCULAR or QF_VALUE_POOL.
+ * Return 0, QF_INVALID or QF_NO_SPACE. */
+int hm_split(const HM *src, uint32_t k, HM *dst);
+
+/* Merge the 2^k partitions `src` into `dst`, allocated here.
+ * Return as hm_split. */
+int hm_merge(const HM *src, uint32_t k, HM *dst);
+
+/* Set the value of `key` in place, inserting it if missing.
+ * Return 1 if the key was there, 0 if it was inserted, or an error. */
+int hm_upsert(HM *hm, uint64_t key, uint64_t value, uint8_t flags);
+
+/* Add `delta` to the value of `key`, 0 if missing; the old value goes in
+ * `old_value`. Return as hm_upsert. */
+int hm_fetch_add(HM *hm, uint64_t key, uint64_t delta, uint64_t *old_value,
+                 uint8_t flags);
+
+/* Set the value of `key` to `desired` if it is `*expected`, else load it
+ * into `*expected`. Return 0, QF_VALUE_MISMATCH or QF_DOESNT_EXIST. */
+int hm_compare_exchange(HM *hm, uint64_t key, uint64_t *expected,
+                        uint64_t desired, uint8_t flags);
+
+/* Counting mode: the value bits hold a saturating counter per key, so the
+ * map needs at least 1 value bit (QF_INVALID otherwise). */
+
+/* Add `count` to the counter of `key`. Return as hm_upsert. */
+int hm_count_insert(HM *hm, uint64_t key, uint64_t count, uint8_t flags);
+
+/* Take `count` off the counter of `key`, removing the key at zero.
+ * Return 1 if the key is still there, 0 if it was removed, QF_DOESNT_EXIST
+ * or QF_INVALID. */
+int hm_count_remove(HM *hm, uint64_t key, uint64_t count, uint8_t flags);
+
+/* Return the counter of `key`, 0 if it is missing. */
+uint64_t hm_count(const HM *hm, uint64_t key, uint8_t flags);
+
+/* Aggregates wrap at value_bits for HM_AGG_COUNT and HM_AGG_SUM. */
+enum hm_agg_op { HM_AGG_COUNT, HM_AGG_SUM, HM_AGG_MIN, HM_AGG_MAX };
+
+/* Fold `value` into the aggregate of `key`. Return as hm_upsert. */
+int hm_aggregate(HM *hm, uint64_t key, uint64_t value, enum hm_agg_op op,
+                 uint8_t flags);
+
+/* Fold `src` into `dst`, hashed alike, walking both in quotient order with
+ * `nthreads` threads.
+ * Return the number of keys folded, QF_INVALID, or an error. */
+int64_t hm_aggregate_merge(HM *dst, const HM *src, enum hm_agg_op op,
+                           uint32_t nthreads, uint8_t flags);
+
+/* Filter mode: a QF_HASH_DEFAULT map with key_bits below the hash stores
+ * fingerprints, counted in the value bits. With 1 value bit the count
+ * saturates and a removal drops every key sharing the fingerprint. */
+
+/* Return as hm_count_insert. */
+int hm_filter_insert(HM *hm, uint64_t key, uint8_t flags);
+
+/* Return as hm_count_remove. */
+int hm_filter_remove(HM *hm, uint64_t key, uint8_t flags);
+
+/* Return true if `key` may have been inserted. */
+bool hm_filter_query(const HM *hm, uint64_t key, uint8_t flags);
+
+/* Look up `key` into `handle`; `value` may be NULL.
+ * Return 0 or QF_DOESNT_EXIST. */
+int hm_find_handle(const HM *hm, uint64_t key, uint64_t *value,
+                   hm_handle *handle, uint8_t flags);
+
+/* Set the value of the key of `handle`, reprobing only if it is stale.
+ * Return 0 or QF_DOESNT_EXIST. */
+int hm_update_handle(HM *hm, hm_handle *handle, uint64_t value);
+
+/* Remove the key of `handle`. Return as hm_remove. */
+int hm_erase_handle(HM *hm, hm_handle *handle);
+
 int hm_rebuild(const QF *qf, uint8_t flags);
 
 void hm_dump_metrics(const QF *qf, const std::string &dir);
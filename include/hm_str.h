@@ -0,0 +1,63 @@
+#ifndef _HM_STR_H_
+#define _HM_STR_H_
+
+#include "hm.h"
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Hash map with variable-length keys.
+
+	 A slot holds the fingerprint of a key (a hash of key_bits bits, split in
+	 quotient and remainder as usual) and, in its value bits, a reference
+	 into an arena that stores the key bytes and the value. Lookups compare
+	 fingerprints in the table and only read the arena on a match, so slots
+	 stay as narrow as in the integer maps.
+
+	 Keys whose fingerprints collide are chained through the arena. Removed
+	 entries are left in the arena until the dead space outgrows the live
+	 space, then the arena is compacted. */
+
+typedef struct string_hashmap {
+	HM hm;
+	char *arena;
+	uint64_t arena_units;  // Capacity of the arena, in 8 byte units.
+	uint64_t used_units;   // Units handed out, unit 0 is never used.
+	uint64_t dead_units;   // Units held by removed entries.
+	uint64_t max_units;    // Largest arena the references can address.
+} string_hashmap;
+
+typedef string_hashmap HMS;
+
+/* Allocate a map of `nslots` slots with `fingerprint_bits`-bit key hashes
+ * and `ref_bits`-bit arena references, which bound the arena to
+ * 8 << ref_bits bytes. */
+bool hm_str_malloc(HMS *hms, uint64_t nslots, uint64_t fingerprint_bits,
+									 uint64_t ref_bits, uint32_t seed, float max_load_factor);
+
+bool hm_str_free(HMS *hms);
+
+/* Return 0 or more on success, QF_KEY_EXISTS, or QF_NO_SPACE when either
+ * the table or the arena is full. */
+int hm_str_insert(HMS *hms, const void *key, size_t len, uint64_t value,
+									uint8_t flags);
+
+/* Return 0 or QF_DOESNT_EXIST. */
+int hm_str_lookup(const HMS *hms, const void *key, size_t len,
+									uint64_t *value, uint8_t flags);
+
+/* Return 0 or more on success, or QF_DOESNT_EXIST. */
+int hm_str_remove(HMS *hms, const void *key, size_t len, uint8_t flags);
+
+/* Move the live entries to the front of the arena and release the rest. */
+int hm_str_compact(HMS *hms, uint8_t flags);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // _HM_STR_H_
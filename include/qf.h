@@ -113,15 +113,13 @@ static inline int qf_insert1(QF *qf, __uint128_t hash, uint8_t runtime_lock) {
       uint64_t i;
       for (i = hash_bucket_index / QF_SLOTS_PER_BLOCK + 1;
             i <= empty_slot_index / QF_SLOTS_PER_BLOCK; i++) {
-        if (get_block(qf, i)->offset <
-            BITMASK(8 * sizeof(qf->blocks[0].offset)))
+        // Once saturated the offset stays at the escape value.
+        if (get_block(qf, i)->offset < QF_MAX_OFFSET)
           get_block(qf, i)->offset++;
-        else abort();
-        assert(get_block(qf, i)->offset != 0 && get_block(qf, i)->offset < 255);
+        assert(get_block(qf, i)->offset != 0);
       }
 #endif
       qf->metadata->noccupied_slots++;
-      qf->metadata->nelts++;
     }
   }
   return ret_distance;
@@ -131,22 +129,17 @@ int qf_insert(HM *qf, uint64_t key, uint64_t value, uint8_t flags) {
   if (qf->metadata->noccupied_slots >= qf->metadata->nslots * 0.99) {
     return QF_NO_SPACE;
   }
-  if (GET_KEY_HASH(flags) != QF_KEY_IS_HASH) {
-    fprintf(stderr, "RobinHood HM assumes key is hash for now.");
-    abort();
-  }
-  uint64_t hash = key;
+  uint64_t hash = key2hash(qf, key, flags);
   hash = (hash<< qf->metadata->value_bits) |
                   (value & BITMASK(qf->metadata->value_bits));
   return qf_insert1(qf, hash, flags);
 }
 
+static int _qf_remove_at(HM *qf, uint64_t hash_bucket_index,
+                         uint64_t runstart_index, uint64_t current_index);
+
 int qf_remove(HM *qf, uint64_t key, uint8_t flags) {
-  if (GET_KEY_HASH(flags) != QF_KEY_IS_HASH) {
-    fprintf(stderr, "RobinHood HM assumes key is hash for now.");
-    abort();
-  }
-  uint64_t hash = key;
+  uint64_t hash = key2hash(qf, key, flags);
   uint64_t hash_remainder = hash & BITMASK(qf->metadata->key_remainder_bits);
   int64_t hash_bucket_index = hash >> qf->metadata->key_remainder_bits;
 
@@ -156,7 +149,6 @@ int qf_remove(HM *qf, uint64_t key, uint8_t flags) {
 
   uint64_t runstart_index =
       hash_bucket_index == 0 ? 0 : run_end(qf, hash_bucket_index - 1) + 1;
-  int only_item_in_the_run = 0;
   uint64_t current_index = runstart_index;
   uint64_t current_remainder = get_slot_remainder(qf, current_index);
   while (current_remainder < hash_remainder && !is_runend(qf, current_index)) {
@@ -166,6 +158,14 @@ int qf_remove(HM *qf, uint64_t key, uint8_t flags) {
 	if (current_remainder != hash_remainder)
 		return QF_DOESNT_EXIST;
 
+  return _qf_remove_at(qf, hash_bucket_index, runstart_index, current_index);
+}
+
+/* Remove the item at `current_index`, found in the run of `hash_bucket_index`
+ * that starts at `runstart_index`. */
+static int _qf_remove_at(HM *qf, uint64_t hash_bucket_index,
+                         uint64_t runstart_index, uint64_t current_index) {
+  int only_item_in_the_run = 0;
   if (runstart_index == current_index && is_runend(qf, current_index))
 		only_item_in_the_run = 1;
   uint64_t *p = 0x00; // The New Counter length is 0.
@@ -181,12 +181,40 @@ int qf_remove(HM *qf, uint64_t key, uint8_t flags) {
 
 }
 
+/* Find the slot holding `key`.
+ * Return 1 and fill `pos` if found, 0 otherwise.
+ */
+static inline int qf_find_key(const QF *qf, uint64_t key, uint8_t flags,
+                              qfposition *pos) {
+  uint64_t hash = key2hash(qf, key, flags);
+  uint64_t hash_remainder = hash & BITMASK(qf->metadata->key_remainder_bits);
+  int64_t hash_bucket_index = hash >> qf->metadata->key_remainder_bits;
+  if (!is_occupied(qf, hash_bucket_index))
+    return 0;
+
+  int64_t runstart_index =
+      hash_bucket_index == 0 ? 0 : run_end(qf, hash_bucket_index - 1) + 1;
+  if (runstart_index < hash_bucket_index)
+    runstart_index = hash_bucket_index;
+
+  uint64_t current_index = runstart_index;
+  do {
+    if (get_slot_remainder(qf, current_index) == hash_remainder) {
+      pos->quotient = hash_bucket_index;
+      pos->index = current_index;
+      pos->run_start = runstart_index;
+      while (!is_runend(qf, current_index))
+        current_index++;
+      pos->run_end = current_index + 1;
+      return 1;
+    }
+    current_index++;
+  } while (!is_runend(qf, current_index - 1));
+  return 0;
+}
+
 int qf_lookup(const QF *qf, uint64_t key, uint64_t *value, uint8_t flags) {
-  if (GET_KEY_HASH(flags) != QF_KEY_IS_HASH) {
-    fprintf(stderr, "RobinHood HM assumes key is hash for now.");
-    abort();
-  }
-  uint64_t hash = key;
+  uint64_t hash = key2hash(qf, key, flags);
   uint64_t hash_remainder = hash & BITMASK(qf->metadata->key_remainder_bits);
   int64_t hash_bucket_index = hash >> qf->metadata->key_remainder_bits;
   if (!is_occupied(qf, hash_bucket_index))
@@ -203,7 +231,7 @@ int qf_lookup(const QF *qf, uint64_t key, uint64_t *value, uint8_t flags) {
     current_slot_value = get_slot(qf, current_index);
     current_remainder = current_slot_value >> qf->metadata->value_bits;
     if (current_remainder == hash_remainder) {
-      *value = current_slot_value & BITMASK(qf->metadata->value_bits);
+      *value = get_slot_value(qf, current_index);
       return (current_index - runstart_index + 1);
     }
     current_index++;
@@ -12,6 +12,31 @@ int qft_remove(HM *qf, uint64_t key, uint8_t flags);
 int qft_query(const QF *qf, uint64_t key, uint64_t *value, uint8_t flags);
 void qft_rebuild(QF *qf, uint8_t flags);
 
+#ifdef QF_TTL
+static int _qft_remove_at(HM *qf, uint64_t hash_bucket_index,
+                          uint64_t current_index, uint64_t runstart_index,
+                          uint64_t runend_index);
+
+/* Turn the expired items of runs [`from_run`, `until_run`) into tombstones,
+ * right before the same runs are rebuilt. */
+static void _expire_window(HM *hm, size_t from_run, size_t until_run) {
+  for (size_t run = find_next_run(hm, from_run); run < until_run;
+       run = find_next_run(hm, run + 1)) {
+    const uint64_t runstart_index = run_start(hm, run);
+    const uint64_t runend_index = runends_select(hm, runstart_index, 0) + 1;
+    // Backwards, so removals don't move the slots still to be checked.
+    for (uint64_t index = runend_index; index-- > runstart_index;) {
+      if (is_tombstone(hm, index) || !is_slot_expired(hm, index))
+        continue;
+#ifdef QF_VALUE_POOL
+      pool_release(hm, get_slot_pool_index(hm, index));
+#endif
+      _qft_remove_at(hm, run, index, runstart_index, runend_index);
+    }
+  }
+}
+#endif
+
 #ifdef REBUILD_DEAMORTIZED_GRAVEYARD
 /* Start at `qf->metadata->rebuild_run`, 
  * rebuild `qf->metadata->rebuild_interval` quotients. 
@@ -32,6 +57,9 @@ int _deamortized_rebuild(HM *hm) {
     until_run = hm->metadata->nslots;
     hm->metadata->rebuild_run = 0;
   }
+#ifdef QF_TTL
+  _expire_window(hm, from_run, until_run);
+#endif
 #ifdef REBUILD_NO_INSERT
   return _rebuild_no_insertion(hm, from_run, until_run, hm->metadata->tombstone_space);
 #else
@@ -65,6 +93,9 @@ int _deamortized_rebuild(HM *hm, uint64_t key, uint8_t flags) {
     until_run = hm->metadata->nslots;
     hm->metadata->rebuild_run = 0;
   }
+#ifdef QF_TTL
+  _expire_window(hm, from_run, until_run);
+#endif
   return _rebuild_1round(hm, from_run, until_run, ts_space);
 }
 #endif
@@ -77,10 +108,6 @@ int qft_insert(QF *const qf, uint64_t key, uint64_t value, uint8_t flags) {
     qft_rebuild(qf, QF_NO_LOCK);
     if (occupied_slots == qf->metadata->nslots) return QF_NO_SPACE;
   }
-  if (GET_KEY_HASH(flags) != QF_KEY_IS_HASH) {
-    fprintf(stderr, "RobinHood Tombstone HM assumes key is hash for now.");
-    abort();
-  }
 #endif
   size_t ret_distance = 0;
   uint64_t hash = key2hash(qf, key, flags);
@@ -90,6 +117,10 @@ int qft_insert(QF *const qf, uint64_t key, uint64_t value, uint8_t flags) {
                        (value & BITMASK(qf->metadata->value_bits));
 
   if (is_empty_ts(qf, hash_bucket_index)) {
+#ifdef QF_CIRCULAR
+    if (!has_other_empty_slot(qf))
+      return QF_NO_SPACE;
+#endif
     set_slot(qf, hash_bucket_index, new_value);
     SET_R(qf, hash_bucket_index);
     SET_O(qf, hash_bucket_index);
@@ -100,8 +131,19 @@ int qft_insert(QF *const qf, uint64_t key, uint64_t value, uint8_t flags) {
     uint64_t insert_index, runstart_index, runend_index;
     int ret = find(qf, hash_bucket_index, hash_remainder, &insert_index,
                    &runstart_index, &runend_index);
-    if (ret == 1)
+    if (ret == 1) {
+  #ifdef QF_TTL
+      // An expired item is gone as far as users can tell, take its slot.
+      if (is_slot_expired(qf, insert_index)) {
+    #ifdef QF_VALUE_POOL
+        pool_release(qf, get_slot_pool_index(qf, insert_index));
+    #endif
+        set_slot(qf, insert_index, new_value);
+        return insert_index - hash_bucket_index + 1;
+      }
+  #endif
       return QF_KEY_EXISTS;
+    }
   #ifdef UNORDERED
     if (is_occupied(qf, hash_bucket_index) && insert_index < runend_index) {
       // If slot is found inside a runend, it must be a tombstone.
@@ -116,10 +158,15 @@ int qft_insert(QF *const qf, uint64_t key, uint64_t value, uint8_t flags) {
   #endif
     uint64_t available_slot_index = find_next_tombstone(qf, insert_index);
     uint64_t run_shift_end = available_slot_index;
-    if (available_slot_index >= qf->metadata->xnslots)
+    if (past_table_end(qf, insert_index, available_slot_index))
       return QF_NO_SPACE;
-    if (is_empty_ts(qf, available_slot_index))
+    if (is_empty_ts(qf, available_slot_index)) {
+  #ifdef QF_CIRCULAR
+      if (!has_other_empty_slot(qf))
+        return QF_NO_SPACE;
+  #endif
       qf->metadata->noccupied_slots++;
+    }
   #if defined(UNORDERED) && defined(SWAP_TOMBSTONE)
     // Shift the tombstone to available_slot_index by swapping runend values
     // of runs in between.
@@ -164,24 +211,14 @@ int qft_insert(QF *const qf, uint64_t key, uint64_t value, uint8_t flags) {
   return ret_distance;
 }
 
-int qft_remove(HM *qf, uint64_t key, uint8_t flags) {
-  uint64_t hash = key2hash(qf, key, flags);
-  uint64_t hash_remainder, hash_bucket_index;
-  quotien_remainder(qf, hash, &hash_bucket_index, &hash_remainder);
-
-  /* Empty bucket */
-  if (!is_occupied(qf, hash_bucket_index))
-    return QF_DOESNT_EXIST;
-
-  uint64_t current_index, runstart_index, runend_index;
-  int ret = find(qf, hash_bucket_index, hash_remainder, &current_index,
-                 &runstart_index, &runend_index);
-  // remainder not found
-  if (ret == 0)
-    return QF_DOESNT_EXIST;
-  
+/* Remove the item at `current_index`, found in the run of `hash_bucket_index`
+ * that spans [runstart_index, runend_index). */
+static int _qft_remove_at(HM *qf, uint64_t hash_bucket_index,
+                          uint64_t current_index, uint64_t runstart_index,
+                          uint64_t runend_index) {
   SET_T(qf, current_index);
   qf->metadata->nelts--;
+  const uint64_t last_index = current_index;
 
   // Make sure that the run never end with a tombstone.
   while (is_runend(qf, current_index) && is_tombstone(qf, current_index)) {
@@ -189,13 +226,9 @@ int qft_remove(HM *qf, uint64_t key, uint8_t flags) {
     // if it is the only element in the run
     if (current_index - runstart_index == 0) {
       RESET_O(qf, hash_bucket_index);
-      if (is_empty_ts(qf, current_index))
-        qf->metadata->noccupied_slots--;
       break;
     } else {
       SET_R(qf, current_index-1);
-      if (is_empty_ts(qf, current_index))
-        qf->metadata->noccupied_slots--;
       --current_index;
     }
   }
@@ -205,25 +238,18 @@ int qft_remove(HM *qf, uint64_t key, uint8_t flags) {
 #else
   _recalculate_block_offsets(qf, hash_bucket_index);
 #endif
+  // The slots the run let go of are free unless a later run covers them,
+  // which the block offsets only tell once they are fixed.
+  for (uint64_t i = current_index + is_occupied(qf, hash_bucket_index);
+       i <= last_index; i++) {
+    if (is_empty_ts(qf, i))
+      qf->metadata->noccupied_slots--;
+  }
 
   return current_index - runstart_index + 1;
 }
 
-/* Assume tombstone is in a run, push it to the end of the run.
- * Return the index of the new tombstone (end of the run).
- */
-size_t _push_tombstone_to_run_end(HM *qf, size_t tombstone_index) {
-  RESET_T(qf, tombstone_index);
-  while (!is_runend(qf, tombstone_index)) {
-    // push 1 slot at a time.
-    set_slot(qf, tombstone_index, get_slot(qf, tombstone_index+1));
-    tombstone_index++;
-  }
-  SET_T(qf, tombstone_index);
-  return tombstone_index;
-}
-
-int qft_remove_push(HM *qf, uint64_t key, uint8_t flags) {
+int qft_remove(HM *qf, uint64_t key, uint8_t flags) {
   uint64_t hash = key2hash(qf, key, flags);
   uint64_t hash_remainder, hash_bucket_index;
   quotien_remainder(qf, hash, &hash_bucket_index, &hash_remainder);
@@ -238,7 +264,35 @@ int qft_remove_push(HM *qf, uint64_t key, uint8_t flags) {
   // remainder not found
   if (ret == 0)
     return QF_DOESNT_EXIST;
-  
+#ifdef QF_TTL
+  // Left for the rebuild windows, like the other expired items.
+  if (is_slot_expired(qf, current_index))
+    return QF_DOESNT_EXIST;
+#endif
+
+  return _qft_remove_at(qf, hash_bucket_index, current_index, runstart_index,
+                        runend_index);
+}
+
+/* Assume tombstone is in a run, push it to the end of the run.
+ * Return the index of the new tombstone (end of the run).
+ */
+size_t _push_tombstone_to_run_end(HM *qf, size_t tombstone_index) {
+  RESET_T(qf, tombstone_index);
+  while (!is_runend(qf, tombstone_index)) {
+    // push 1 slot at a time.
+    set_slot(qf, tombstone_index, get_slot(qf, tombstone_index+1));
+    tombstone_index++;
+  }
+  SET_T(qf, tombstone_index);
+  return tombstone_index;
+}
+
+/* Same as _qft_remove_at, pushing the new tombstone to the end of the
+ * cluster or the next primitive tombstone position. */
+static int _qft_remove_push_at(HM *qf, uint64_t hash_bucket_index,
+                               uint64_t current_index, uint64_t runstart_index,
+                               uint64_t runend_index) {
   SET_T(qf, current_index);
   qf->metadata->nelts--;
 
@@ -288,26 +342,67 @@ int qft_remove_push(HM *qf, uint64_t key, uint8_t flags) {
   return current_index - runstart_index + 1;
 }
 
-int qft_query(const QF *qf, uint64_t key, uint64_t *value, uint8_t flags) {
+int qft_remove_push(HM *qf, uint64_t key, uint8_t flags) {
   uint64_t hash = key2hash(qf, key, flags);
   uint64_t hash_remainder, hash_bucket_index;
   quotien_remainder(qf, hash, &hash_bucket_index, &hash_remainder);
 
+  /* Empty bucket */
   if (!is_occupied(qf, hash_bucket_index))
     return QF_DOESNT_EXIST;
 
   uint64_t current_index, runstart_index, runend_index;
   int ret = find(qf, hash_bucket_index, hash_remainder, &current_index,
                  &runstart_index, &runend_index);
+  // remainder not found
   if (ret == 0)
     return QF_DOESNT_EXIST;
-  *value = get_slot(qf, current_index) & BITMASK(qf->metadata->value_bits);
+#ifdef QF_TTL
+  // Left for the rebuild windows, like the other expired items.
+  if (is_slot_expired(qf, current_index))
+    return QF_DOESNT_EXIST;
+#endif
+
+  return _qft_remove_push_at(qf, hash_bucket_index, current_index,
+                             runstart_index, runend_index);
+}
+
+/* Find the slot holding `key`.
+ * Return 1 and fill `pos` if found, 0 otherwise.
+ */
+static inline int qft_find_key(const QF *qf, uint64_t key, uint8_t flags,
+                               qfposition *pos) {
+  uint64_t hash = key2hash(qf, key, flags);
+  uint64_t hash_remainder;
+  quotien_remainder(qf, hash, &pos->quotient, &hash_remainder);
+
+  if (!is_occupied(qf, pos->quotient))
+    return 0;
+
+  if (!find(qf, pos->quotient, hash_remainder, &pos->index, &pos->run_start,
+            &pos->run_end))
+    return 0;
+#ifdef QF_TTL
+  if (is_slot_expired(qf, pos->index))
+    return 0;
+#endif
+  return 1;
+}
+
+int qft_query(const QF *qf, uint64_t key, uint64_t *value, uint8_t flags) {
+  qfposition pos;
+  if (!qft_find_key(qf, key, flags, &pos))
+    return QF_DOESNT_EXIST;
+  *value = get_slot_value(qf, pos.index);
   return 0;
 }
 
 
 
 void qft_rebuild(QF *hm, uint8_t flags) {
+#ifdef QF_TTL
+  _expire_window(hm, 0, hm->metadata->nslots);
+#endif
 #ifdef REBUILD_BY_CLEAR
     _clear_tombstones(hm);
     reset_rebuild_cd(hm);
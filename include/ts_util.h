@@ -7,6 +7,9 @@
 #include "util.h"
 #include <math.h>
 #include <stdio.h>
+#if defined(__SSE2__) && !defined(QF_SCALAR_SHIFT)
+#include <emmintrin.h>
+#endif
 
 #ifdef QF_TOMBSTONE
 
@@ -18,36 +21,97 @@ static inline int is_tombstone(const QF *qf, uint64_t index) {
 
 /* Find the previous runend from this position, excluding that position. */
 static inline size_t find_prev_runend(QF *qf, size_t slot) {
-  size_t block_index = slot / QF_SLOTS_PER_BLOCK;
-  const size_t slot_offset = slot % QF_SLOTS_PER_BLOCK;
-  size_t block_runend_word = get_block(qf, block_index)->runends[0];
+  size_t word_index = slot / 64;
   // mask the higher order bits, these are positions that come after the slot.
-  block_runend_word = (block_runend_word & BITMASK(slot_offset)); 
-  uint64_t mask = BITMASK(slot);
-  size_t prev = bitscanreverse(block_runend_word);
-  if (prev != BITMASK(64)) {
-    return block_index * QF_SLOTS_PER_BLOCK + prev;
+  uint64_t runend_word = METADATA_WORD(qf, runends, slot) & BITMASK(slot % 64);
+  while (runend_word == 0) {
+#ifdef QF_BLOCK_SUMMARY
+    if (word_index % QF_METADATA_WORDS_PER_BLOCK == 0) {
+      // Jump past the end of the previous block that has a runend.
+      word_index = (summary_prev(qf, qf->runend_summary,
+                                 word_index / QF_METADATA_WORDS_PER_BLOCK - 1) +
+                    1) * QF_METADATA_WORDS_PER_BLOCK;
+    }
+#endif
+    word_index--;
+    runend_word = METADATA_WORD(qf, runends, 64 * word_index);
   }
-  do {
-    block_runend_word = get_block(qf, --block_index)->runends[0];
-  } while (block_runend_word == 0);
-  prev = bitscanreverse(block_runend_word);
-  return block_index * QF_SLOTS_PER_BLOCK + prev;
+  return word_index * 64 + bitscanreverse(runend_word);
 }
 
-/* Find the first tombstone in [from, xnslots), it can be empty or not empty. */
+/* Find the first tombstone in [from, xnslots), it can be empty or not empty.
+ * Use past_table_end to check the result. */
 static inline size_t find_next_tombstone(QF *qf, size_t from) {
-  size_t block_index = from / QF_SLOTS_PER_BLOCK;
-  const size_t slot_offset = from % QF_SLOTS_PER_BLOCK;
+  size_t word_index = from / 64;
+#ifdef QF_CIRCULAR
+  // Search at most one lap around the table.
+  const size_t end_word =
+      word_index + qf->metadata->nblocks * QF_METADATA_WORDS_PER_BLOCK + 1;
+#else
+  const size_t end_word = qf->metadata->nblocks * QF_METADATA_WORDS_PER_BLOCK;
+#endif
   size_t tomb_offset =
-      bitselectv(get_block(qf, block_index)->tombstones[0], slot_offset, 0);
-  while (tomb_offset == 64) { // No tombstone in the rest of this block.
-    block_index++;
-    tomb_offset = bitselect(get_block(qf, block_index)->tombstones[0], 0);
+      bitselectv(METADATA_WORD(qf, tombstones, from), from % 64, 0);
+  while (tomb_offset == 64) { // No tombstone in the rest of this word.
+#ifdef QF_BLOCK_SUMMARY
+    // Jump over the full blocks in one go.
+    word_index = summary_next_word(qf, qf->tombstone_summary, word_index);
+#else
+    word_index++;
+#endif
+    if (word_index >= end_word)
+      return end_word * 64;
+    tomb_offset = bitselect(METADATA_WORD(qf, tombstones, 64 * word_index), 0);
+  }
+  return word_index * 64 + tomb_offset;
+}
+
+/* Find the first slot in [from, ...) that isn't a tombstone. Runs never end
+ * with a tombstone, so from inside a run this stops at its runend at the
+ * latest. */
+static inline size_t find_next_item(const QF *qf, size_t from) {
+  size_t word_index = from / 64;
+  uint64_t items = ~METADATA_WORD(qf, tombstones, from) & ~BITMASK(from % 64);
+  while (items == 0) {
+    word_index++;
+    items = ~METADATA_WORD(qf, tombstones, 64 * word_index);
   }
-  return block_index * QF_SLOTS_PER_BLOCK + tomb_offset;
+  return word_index * 64 + bitscanforward(items);
+}
+
+#if defined(__SSE2__) && !defined(QF_SCALAR_SHIFT)
+/* The runends word (low lane) and tombstones word (high lane) at `word`. */
+static inline __m128i load_runends_tombstones(const QF *qf, size_t word) {
+  const qfblock *block = get_block(qf, word / QF_METADATA_WORDS_PER_BLOCK);
+  const size_t w = word % QF_METADATA_WORDS_PER_BLOCK;
+  return _mm_set_epi64x(block->tombstones[w], block->runends[w]);
+}
+
+static inline void store_runends_tombstones(QF *qf, size_t word, __m128i v) {
+  qfblock *block = get_block(qf, word / QF_METADATA_WORDS_PER_BLOCK);
+  const size_t w = word % QF_METADATA_WORDS_PER_BLOCK;
+  block->runends[w] = _mm_cvtsi128_si64(v);
+  block->tombstones[w] = _mm_cvtsi128_si64(_mm_unpackhi_epi64(v, v));
 }
 
+/* shift_into_b on both lanes. The shift counts are passed as vectors so
+ * the caller builds them once per shift. */
+static inline __m128i shift_into_b_x2(const __m128i a, const __m128i b,
+                                      const int bstart, const int bend,
+                                      const __m128i amount,
+                                      const __m128i rev_amount) {
+  const __m128i a_component =
+      bstart == 0 ? _mm_srl_epi64(a, rev_amount) : _mm_setzero_si128();
+  const __m128i b_shifted_mask =
+      _mm_set1_epi64x(BITMASK(bend - bstart) << bstart);
+  const __m128i b_shifted = _mm_and_si128(
+      _mm_sll_epi64(_mm_and_si128(b_shifted_mask, b), amount), b_shifted_mask);
+  return _mm_or_si128(
+      _mm_or_si128(_mm_and_si128(a_component, b_shifted_mask), b_shifted),
+      _mm_andnot_si128(b_shifted_mask, b));
+}
+#endif
+
 /* Shift metadata runends and tombstones in range [first, last) to the big
  * direction by distance.
  * `last` to `last+distance-1` will be replaced. Fill with 0s in the small size.
@@ -55,14 +119,47 @@ static inline size_t find_next_tombstone(QF *qf, size_t from) {
 static inline void shift_runends_tombstones(QF *qf, int64_t first,
                                             uint64_t last, uint64_t distance) {
 #ifdef DEBUG
+#ifndef QF_CIRCULAR
   assert(last < qf->metadata->xnslots);
+#endif
   assert(distance < 64);
 #endif
   uint64_t first_word = first / 64;
   uint64_t bstart = first % 64;
   uint64_t last_word = (last + distance - 1) / 64;
   uint64_t bend = (last + distance - 1) % 64 + 1;
+#ifdef QF_BLOCK_SUMMARY
+  const uint64_t summary_last_word = last_word;
+#endif
 
+#if defined(__SSE2__) && !defined(QF_SCALAR_SHIFT)
+  // Both bitmaps move in one pass, and each word is loaded only once: the
+  // previous word of this step is the current word of the next one.
+  const __m128i amount = _mm_cvtsi32_si128(distance);
+  const __m128i rev_amount = _mm_cvtsi32_si128(64 - distance);
+  __m128i cur = load_runends_tombstones(qf, last_word);
+  if (last_word != first_word) {
+    __m128i prev = load_runends_tombstones(qf, last_word - 1);
+    store_runends_tombstones(
+        qf, last_word,
+        shift_into_b_x2(prev, cur, 0, bend, amount, rev_amount));
+    cur = prev;
+    bend = 64;
+    last_word--;
+    while (last_word != first_word) {
+      // Whole words, the low bits come in from the previous word.
+      prev = load_runends_tombstones(qf, last_word - 1);
+      store_runends_tombstones(qf, last_word,
+                               _mm_or_si128(_mm_sll_epi64(cur, amount),
+                                            _mm_srl_epi64(prev, rev_amount)));
+      cur = prev;
+      last_word--;
+    }
+  }
+  store_runends_tombstones(qf, last_word,
+                           shift_into_b_x2(_mm_setzero_si128(), cur, bstart,
+                                           bend, amount, rev_amount));
+#else
   if (last_word != first_word) {
     METADATA_WORD(qf, runends, 64 * last_word) = shift_into_b(
         METADATA_WORD(qf, runends, 64 * (last_word - 1)),
@@ -86,6 +183,11 @@ static inline void shift_runends_tombstones(QF *qf, int64_t first,
       0, METADATA_WORD(qf, runends, 64 * last_word), bstart, bend, distance);
   METADATA_WORD(qf, tombstones, 64 * last_word) = shift_into_b(
       0, METADATA_WORD(qf, tombstones, 64 * last_word), bstart, bend, distance);
+#endif
+#ifdef QF_BLOCK_SUMMARY
+  summary_sync_blocks(qf, first_word / QF_METADATA_WORDS_PER_BLOCK,
+                      summary_last_word / QF_METADATA_WORDS_PER_BLOCK);
+#endif
 }
 
 
@@ -94,6 +196,15 @@ static inline bool is_empty_ts(const QF *qf, uint64_t slot_index) {
   return offset_lower_bound(qf, slot_index) == 0;
 }
 
+#ifdef QF_CIRCULAR
+/* Whether an empty slot is left once one more is taken. Runs must never
+ * cover the whole circular table, or positions can't be told apart across
+ * laps. noccupied_slots counts the slots covered by runs. */
+static inline bool has_other_empty_slot(const QF *qf) {
+  return qf->metadata->noccupied_slots + 1 < qf->metadata->nslots;
+}
+#endif
+
 /* Find next tombstone/empty `available` in range [index, nslots)
  * Shift everything in range [index, available) by 1 to the big direction.
  * Make a tombstone at `index`
@@ -103,10 +214,14 @@ static inline bool is_empty_ts(const QF *qf, uint64_t slot_index) {
 static inline int _insert_ts_at(QF *const qf, size_t index, size_t run) {
   if (is_tombstone(qf, index)) return 0;
   size_t available_slot_index = find_next_tombstone(qf, index);
-  if (available_slot_index >= qf->metadata->xnslots) return QF_NO_SPACE;
+  if (past_table_end(qf, index, available_slot_index)) return QF_NO_SPACE;
   // Change counts
-  if (is_empty(qf, available_slot_index))
+  if (is_empty(qf, available_slot_index)) {
+#ifdef QF_CIRCULAR
+    if (!has_other_empty_slot(qf)) return QF_NO_SPACE;
+#endif
     qf->metadata->noccupied_slots++;
+  }
   // shift slot and metadata
   shift_remainders(qf, index, available_slot_index);
   shift_runends_tombstones(qf, index, available_slot_index, 1);
@@ -135,16 +250,16 @@ static inline int _insert_pts(QF *const qf, size_t run) {
 static inline size_t tombstones_cnt(const QF *qf, size_t start, size_t len) {
   size_t cnt = 0;
   size_t end = start + len;
-  size_t block_i = start / QF_SLOTS_PER_BLOCK;
-  size_t bstart = start % QF_SLOTS_PER_BLOCK;
+  size_t word_i = start / 64;
+  size_t bstart = start % 64;
   do {
-    size_t word = get_block(qf, block_i)->tombstones[0];
+    size_t word = METADATA_WORD(qf, tombstones, 64 * word_i);
     cnt += popcntv(word, bstart);
-    block_i++;
+    word_i++;
     bstart = 0;
-  } while ((block_i) * QF_SLOTS_PER_BLOCK <= end);
-  size_t word = get_block(qf, block_i-1)->tombstones[0];
-  cnt -= popcntv(word, end % QF_SLOTS_PER_BLOCK);
+  } while (word_i * 64 <= end);
+  size_t word = METADATA_WORD(qf, tombstones, 64 * (word_i - 1));
+  cnt -= popcntv(word, end % 64);
   return cnt;
 }
 
@@ -234,6 +349,21 @@ static void _push_over_run_skip_ts(QF *qf, size_t *push_start, size_t *push_end,
 }
 
 
+/* The pushing tombstones left after the last run of a cluster are free up
+ * to `next_run`, the next occupied quotient. In circular mode they may go
+ * past the end of the table, up to the first run of the next lap. */
+static inline size_t _free_until(const QF *qf, size_t next_run) {
+#ifdef QF_CIRCULAR
+  if (next_run >= qf->metadata->nslots) {
+    const size_t first_run = find_next_run(qf, 0);
+    if (first_run < qf->metadata->nslots)
+      return first_run + qf->metadata->nslots;
+    return SIZE_MAX;
+  }
+#endif
+  return next_run;
+}
+
 /* Rebuild quotien [`from_run`, `until_run`). Leave the pushing tombstones at
  * the beginning of until_run. Here we do rebuild run by run. 
  * Return the number of pushing tombstones at the end.
@@ -254,8 +384,9 @@ static void _clear_tombstones(QF *qf) {
 #endif
     // find the next run
     curr_quotien = find_next_run(qf, ++curr_quotien);
-    if (push_start < curr_quotien) {  // Reached the end of the cluster.
-      size_t n_to_free = MIN(curr_quotien, push_end) - push_start;
+    const size_t free_until = _free_until(qf, curr_quotien);
+    if (push_start < free_until) {  // Reached the end of the cluster.
+      size_t n_to_free = MIN(free_until, push_end) - push_start;
       if (n_to_free > 0)
         qf->metadata->noccupied_slots -= n_to_free;
       push_start = curr_quotien;
@@ -327,8 +458,9 @@ static inline int _rebuild_1round(QF *grhm, size_t from_run, size_t until_run, s
 #endif
     // find the next run
     curr_run = find_next_run(grhm, ++curr_run);
-    if (push_start < curr_run) {  // Reached the end of the cluster.
-      size_t n_to_free = MIN(curr_run, push_end) - push_start;
+    const size_t free_until = _free_until(grhm, curr_run);
+    if (push_start < free_until) {  // Reached the end of the cluster.
+      size_t n_to_free = MIN(free_until, push_end) - push_start;
       if (n_to_free > 0)
         grhm->metadata->noccupied_slots -= n_to_free;
       push_start = curr_run;
@@ -362,10 +494,11 @@ static int _rebuild_no_insertion(QF *grhm, size_t from_run, size_t until_run, si
 #endif
     // find the next run
     curr_run = find_next_run(grhm, ++curr_run);
-    if (push_start < curr_run) {  // Reached the end of the cluster.
-      size_t n_to_free = MIN(curr_run, push_end) - push_start;
+    const size_t free_until = _free_until(grhm, curr_run);
+    if (push_start < free_until) {  // Reached the end of the cluster.
+      size_t n_to_free = MIN(free_until, push_end) - push_start;
       if (n_to_free > 0)
-        grhm->metadata->noccupied_slots -= -n_to_free;
+        grhm->metadata->noccupied_slots -= n_to_free;
       push_start = curr_run;
       push_end = MAX(push_end, push_start);
     }
@@ -406,9 +539,7 @@ static void reset_rebuild_cd(HM *hm) {
 static int find(const QF *qf, const uint64_t quotient, const uint64_t remainder,
                 uint64_t *const index, uint64_t *const run_start_index,
                 uint64_t *const run_end_index) {
-  *run_start_index = 0;
-  if (quotient != 0)
-    *run_start_index = run_end(qf, quotient - 1) + 1;
+  *run_start_index = run_start(qf, quotient);
   *index = *run_start_index;
   if (!is_occupied(qf, quotient)) {
     // no such run
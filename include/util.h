@@ -20,24 +20,42 @@
 #define METADATA_WORD(qf, field, slot_index)                                   \
   (get_block((qf), (slot_index) / QF_SLOTS_PER_BLOCK)                          \
        ->field[((slot_index) % QF_SLOTS_PER_BLOCK) / 64])
+#ifdef QF_BLOCK_SUMMARY
+#define SUMMARY_BIT(qf, index)                                                 \
+  (1ULL << (QF_BLOCK_INDEX((qf), (index) / QF_SLOTS_PER_BLOCK) % 64))
+#define SUMMARY_WORD(qf, summary, index)                                       \
+  ((summary)[QF_BLOCK_INDEX((qf), (index) / QF_SLOTS_PER_BLOCK) / 64])
+// Mark the block of `index` as having a set bit in `field`.
+#define SUMMARY_MARK(qf, summary, index)                                       \
+  (SUMMARY_WORD((qf), (qf)->summary, (index)) |= SUMMARY_BIT((qf), (index)))
+// Recompute the summary bit of the block of `index` from `field`.
+#define SUMMARY_SYNC(qf, summary, field, index)                                \
+  (SUMMARY_WORD((qf), (qf)->summary, (index)) =                                \
+       (SUMMARY_WORD((qf), (qf)->summary, (index)) &                           \
+        ~SUMMARY_BIT((qf), (index))) |                                         \
+       (block_any_##field(get_block((qf), (index) / QF_SLOTS_PER_BLOCK))       \
+            ? SUMMARY_BIT((qf), (index))                                       \
+            : 0))
+#else
+#define SUMMARY_MARK(qf, summary, index) ((void)0)
+#define SUMMARY_SYNC(qf, summary, field, index) ((void)0)
+#endif
 #define SET_O(qf, index)                                                       \
-  (METADATA_WORD((qf), occupieds, (index)) |=                                  \
-   1ULL << ((index) % QF_SLOTS_PER_BLOCK))
+  (METADATA_WORD((qf), occupieds, (index)) |= 1ULL << ((index) % 64))
 #define SET_R(qf, index)                                                       \
-  (METADATA_WORD((qf), runends, (index)) |= 1ULL                               \
-                                            << ((index) % QF_SLOTS_PER_BLOCK))
+  ((METADATA_WORD((qf), runends, (index)) |= 1ULL << ((index) % 64)),          \
+   SUMMARY_MARK((qf), runend_summary, (index)))
 #define SET_T(qf, index)                                                       \
-  (METADATA_WORD((qf), tombstones, (index)) |=                                 \
-   1ULL << ((index) % QF_SLOTS_PER_BLOCK))
+  ((METADATA_WORD((qf), tombstones, (index)) |= 1ULL << ((index) % 64)),       \
+   SUMMARY_MARK((qf), tombstone_summary, (index)))
 #define RESET_O(qf, index)                                                     \
-  (METADATA_WORD((qf), occupieds, (index)) &=                                  \
-   ~(1ULL << ((index) % QF_SLOTS_PER_BLOCK)))
+  (METADATA_WORD((qf), occupieds, (index)) &= ~(1ULL << ((index) % 64)))
 #define RESET_R(qf, index)                                                     \
-  (METADATA_WORD((qf), runends, (index)) &=                                    \
-   ~(1ULL << ((index) % QF_SLOTS_PER_BLOCK)))
+  ((METADATA_WORD((qf), runends, (index)) &= ~(1ULL << ((index) % 64))),       \
+   SUMMARY_SYNC((qf), runend_summary, runends, (index)))
 #define RESET_T(qf, index)                                                     \
-  (METADATA_WORD((qf), tombstones, (index)) &=                                 \
-   ~(1ULL << ((index) % QF_SLOTS_PER_BLOCK)))
+  ((METADATA_WORD((qf), tombstones, (index)) &= ~(1ULL << ((index) % 64))),    \
+   SUMMARY_SYNC((qf), tombstone_summary, tombstones, (index)))
 #define GET_NO_LOCK(flag) (flag & QF_NO_LOCK)
 #define GET_TRY_ONCE_LOCK(flag) (flag & QF_TRY_ONCE_LOCK)
 #define GET_WAIT_FOR_LOCK(flag) (flag & QF_WAIT_FOR_LOCK)
@@ -95,6 +113,28 @@ static inline int64_t bitscanreverse(uint64_t val) {
   }
 }
 
+/* Number of set bits, and whether any bit is set, in `field` of a block
+ * over all its metadata words. qfblock is packed, so the words are read by
+ * value rather than through a pointer to the field. */
+#define BLOCK_FIELD_COUNTS(field)                                              \
+  static inline int block_popcnt_##field(const qfblock *b) {                   \
+    int cnt = 0;                                                               \
+    for (size_t i = 0; i < QF_METADATA_WORDS_PER_BLOCK; i++)                   \
+      cnt += popcnt(b->field[i]);                                              \
+    return cnt;                                                                \
+  }                                                                            \
+  static inline bool block_any_##field(const qfblock *b) {                     \
+    for (size_t i = 0; i < QF_METADATA_WORDS_PER_BLOCK; i++)                   \
+      if (b->field[i])                                                         \
+        return true;                                                           \
+    return false;                                                              \
+  }
+BLOCK_FIELD_COUNTS(occupieds)
+BLOCK_FIELD_COUNTS(runends)
+#ifdef QF_TOMBSTONE
+BLOCK_FIELD_COUNTS(tombstones)
+#endif
+
 static inline int popcntv(const uint64_t val, int ignore) {
   if (ignore % 64)
     return popcnt(val & ~BITMASK(ignore % 64));
@@ -261,6 +301,84 @@ static inline uint64_t bitselect_big(uint64_t val) {
   return i;
 }
 
+#ifdef QF_BLOCK_SUMMARY
+/* Return the first block in [block_index, nblocks) whose bit is set in
+ * `summary`, or nblocks if there is no such block. */
+static inline size_t _summary_next(const QF *qf, const uint64_t *summary,
+                                   size_t block_index) {
+  const size_t nwords = QF_SUMMARY_WORDS(qf->metadata->nblocks);
+  size_t w = block_index / 64;
+  if (w >= nwords)
+    return qf->metadata->nblocks;
+  uint64_t word = summary[w] & ~BITMASK(block_index % 64);
+  while (word == 0) {
+    if (++w == nwords)
+      return qf->metadata->nblocks;
+    word = summary[w];
+  }
+  return w * 64 + bitselect(word, 0);
+}
+
+/* Return the first block from block_index on whose bit is set in `summary`.
+ * Without QF_CIRCULAR returns nblocks if there is no such block. With it the
+ * search wraps around once, block indexes past the end of the table keep
+ * growing, and anything at or past block_index + nblocks means not found. */
+static inline size_t summary_next(const QF *qf, const uint64_t *summary,
+                                  size_t block_index) {
+#ifdef QF_CIRCULAR
+  const size_t nblocks = qf->metadata->nblocks;
+  const size_t base = block_index - QF_BLOCK_INDEX(qf, block_index);
+  size_t next = _summary_next(qf, summary, QF_BLOCK_INDEX(qf, block_index));
+  if (next == nblocks)
+    next = nblocks + _summary_next(qf, summary, 0);
+  return base + next;
+#else
+  return _summary_next(qf, summary, block_index);
+#endif
+}
+
+/* Return the last block at or before block_index whose bit is set in
+ * `summary`. The caller must make sure such a block exists. */
+static inline size_t summary_prev(const QF *qf, const uint64_t *summary,
+                                  size_t block_index) {
+  const size_t phys = QF_BLOCK_INDEX(qf, block_index);
+  size_t base = block_index - phys;
+  size_t w = phys / 64;
+  uint64_t word = summary[w] & BITMASK(phys % 64 + 1);
+  while (word == 0) {
+#ifdef QF_CIRCULAR
+    if (w == 0) {
+      w = QF_SUMMARY_WORDS(qf->metadata->nblocks);
+      base -= qf->metadata->nblocks;
+    }
+#endif
+    word = summary[--w];
+  }
+  return base + w * 64 + bitscanreverse(word);
+}
+
+/* Return the next metadata word after word_index, skipping the whole blocks
+ * whose bit is clear in `summary`. */
+static inline size_t summary_next_word(const QF *qf, const uint64_t *summary,
+                                       size_t word_index) {
+  word_index++;
+  if (word_index % QF_METADATA_WORDS_PER_BLOCK == 0)
+    word_index = summary_next(qf, summary,
+                              word_index / QF_METADATA_WORDS_PER_BLOCK) *
+                 QF_METADATA_WORDS_PER_BLOCK;
+  return word_index;
+}
+
+/* Recompute the summary bits of blocks [from_block, to_block]. */
+static inline void summary_sync_blocks(QF *qf, size_t from_block,
+                                       size_t to_block) {
+  for (size_t b = from_block; b <= to_block; b++) {
+    SUMMARY_SYNC(qf, runend_summary, runends, b * QF_SLOTS_PER_BLOCK);
+    SUMMARY_SYNC(qf, tombstone_summary, tombstones, b * QF_SLOTS_PER_BLOCK);
+  }
+}
+#endif
+
 static inline int is_runend(const QF *qf, uint64_t index) {
   return (METADATA_WORD(qf, runends, index) >>
           ((index % QF_SLOTS_PER_BLOCK) % 64)) &
@@ -278,16 +396,16 @@ static inline int is_occupied(const QF *qf, uint64_t index) {
 static inline size_t runends_cnt(const QF *qf, size_t start, size_t len) {
   size_t cnt = 0;
   size_t end = start + len;
-  size_t block_i = start / QF_SLOTS_PER_BLOCK;
-  size_t bstart = start % QF_SLOTS_PER_BLOCK;
+  size_t word_i = start / 64;
+  size_t bstart = start % 64;
   do {
-    size_t word = get_block(qf, block_i)->runends[0];
+    size_t word = METADATA_WORD(qf, runends, 64 * word_i);
     cnt += popcntv(word, bstart);
-    block_i++;
+    word_i++;
     bstart = 0;
-  } while ((block_i) * QF_SLOTS_PER_BLOCK <= end);
-  size_t word = get_block(qf, block_i-1)->runends[0];
-  cnt -= popcntv(word, end % QF_SLOTS_PER_BLOCK);
+  } while (word_i * 64 <= end);
+  size_t word = METADATA_WORD(qf, runends, 64 * (word_i - 1));
+  cnt -= popcntv(word, end % 64);
   return cnt;
 }
 
@@ -295,16 +413,16 @@ static inline size_t runends_cnt(const QF *qf, size_t start, size_t len) {
 static inline size_t occupieds_cnt(const QF *qf, size_t start, size_t len) {
   size_t cnt = 0;
   size_t end = start + len;
-  size_t block_i = start / QF_SLOTS_PER_BLOCK;
-  size_t bstart = start % QF_SLOTS_PER_BLOCK;
+  size_t word_i = start / 64;
+  size_t bstart = start % 64;
   do {
-    size_t word = get_block(qf, block_i)->occupieds[0];
+    size_t word = METADATA_WORD(qf, occupieds, 64 * word_i);
     cnt += popcntv(word, bstart);
-    block_i++;
+    word_i++;
     bstart = 0;
-  } while ((block_i) * QF_SLOTS_PER_BLOCK <= end);
-  size_t word = get_block(qf, block_i-1)->occupieds[0];
-  cnt -= popcntv(word, end % QF_SLOTS_PER_BLOCK);
+  } while (word_i * 64 <= end);
+  size_t word = METADATA_WORD(qf, occupieds, 64 * (word_i - 1));
+  cnt -= popcntv(word, end % 64);
   return cnt;
 }
 
@@ -312,17 +430,18 @@ static inline size_t occupieds_cnt(const QF *qf, size_t start, size_t len) {
  * If not found, return nslots.
  */
 static inline size_t occupieds_select(const QF *qf, size_t index, size_t r) {
-  size_t block_i = index / QF_SLOTS_PER_BLOCK;
-  size_t bstart = index % QF_SLOTS_PER_BLOCK;
+  size_t word_i = index / 64;
+  size_t bstart = index % 64;
+  const size_t end_word = qf->metadata->nblocks * QF_METADATA_WORDS_PER_BLOCK;
   do {
-    size_t word = get_block(qf, block_i)->occupieds[0];
+    size_t word = METADATA_WORD(qf, occupieds, 64 * word_i);
     size_t pos = bitselectv(word, bstart, r);
     if (pos < sizeof(word) * 8)
-      return block_i * QF_SLOTS_PER_BLOCK + pos;
+      return word_i * 64 + pos;
     r -= popcntv(word, bstart);
     bstart = 0;
-    block_i++;
-  } while (block_i < qf->metadata->nblocks);
+    word_i++;
+  } while (word_i < end_word);
   return qf->metadata->nslots;
 }
 
@@ -330,17 +449,29 @@ static inline size_t occupieds_select(const QF *qf, size_t index, size_t r) {
  * If not found, return nslots.
  */
 static inline size_t runends_select(const QF *qf, size_t index, size_t r) {
-  size_t block_i = index / QF_SLOTS_PER_BLOCK;
-  size_t bstart = index % QF_SLOTS_PER_BLOCK;
+  size_t word_i = index / 64;
+  size_t bstart = index % 64;
+#ifdef QF_CIRCULAR
+  // Runs may wrap around into the first blocks.
+  const size_t end_word =
+      word_i + (qf->metadata->nblocks + 1) * QF_METADATA_WORDS_PER_BLOCK;
+#else
+  const size_t end_word = qf->metadata->nblocks * QF_METADATA_WORDS_PER_BLOCK;
+#endif
   do {
-    uint64_t word = get_block(qf, block_i)->runends[0];
+    uint64_t word = METADATA_WORD(qf, runends, 64 * word_i);
     size_t pos = bitselectv(word, bstart, r);
     if (pos < sizeof(word) * 8)
-      return block_i * QF_SLOTS_PER_BLOCK + pos;
+      return word_i * 64 + pos;
     r -= popcntv(word, bstart);
     bstart = 0;
-    block_i++;
-  } while (block_i < qf->metadata->nblocks);
+#ifdef QF_BLOCK_SUMMARY
+    // Blocks without runends don't change the rank, skip them.
+    word_i = summary_next_word(qf, qf->runend_summary, word_i);
+#else
+    word_i++;
+#endif
+  } while (word_i < end_word);
   fprintf(stderr, "runends_select: reached xnslots.\n");
   return qf->metadata->xnslots;
 }
@@ -349,7 +480,7 @@ static inline size_t runends_select(const QF *qf, size_t index, size_t r) {
     QF_BITS_PER_SLOT == 32 || QF_BITS_PER_SLOT == 64
 
 static inline uint64_t get_slot(const QF *qf, uint64_t index) {
-#ifdef DEBUG
+#if defined(DEBUG) && !defined(QF_CIRCULAR)
   assert(index < qf->metadata->xnslots);
 #endif
   return get_block(qf, index / QF_SLOTS_PER_BLOCK)
@@ -357,7 +488,7 @@ static inline uint64_t get_slot(const QF *qf, uint64_t index) {
 }
 
 static inline void set_slot(const QF *qf, uint64_t index, uint64_t value) {
-#ifdef DEBUG
+#if defined(DEBUG) && !defined(QF_CIRCULAR)
   assert(index < qf->metadata->xnslots);
 #endif
   get_block(qf, index / QF_SLOTS_PER_BLOCK)->slots[index % QF_SLOTS_PER_BLOCK] =
@@ -439,6 +570,124 @@ static inline uint64_t get_slot_remainder(const QF *qf, uint64_t index) {
   return get_slot(qf, index )>> (qf->metadata->value_bits);
 }
 
+/* Value bits of a slot below its expiry time and reference bit. */
+static inline uint64_t slot_data_bits(const QF *qf) {
+  uint64_t bits = qf->metadata->value_bits;
+#ifdef QF_TTL
+  bits -= QF_TTL_BITS;
+#endif
+#ifdef QF_CACHE
+  bits -= 1;
+#endif
+  return bits;
+}
+
+#ifdef QF_CACHE
+
+static inline uint64_t slot_reference_bit(const QF *qf) {
+  return 1ULL << (qf->metadata->value_bits - 1);
+}
+
+static inline bool is_slot_referenced(const QF *qf, uint64_t index) {
+  return get_slot(qf, index) & slot_reference_bit(qf);
+}
+
+static inline void set_slot_referenced(const QF *qf, uint64_t index,
+                                       bool referenced) {
+  const uint64_t slot = get_slot(qf, index) & ~slot_reference_bit(qf);
+  set_slot(qf, index, referenced ? slot | slot_reference_bit(qf) : slot);
+}
+
+#endif
+
+#ifdef QF_VALUE_POOL
+
+/* Mask of the values as the user sees them. */
+static inline uint64_t value_mask(const QF *qf) {
+  return BITMASK(qf->metadata->pool_value_bits);
+}
+
+static inline uint64_t get_slot_pool_index(const QF *qf, uint64_t index) {
+  return get_slot(qf, index) & BITMASK(slot_data_bits(qf));
+}
+
+static inline uint64_t get_slot_value(const QF *qf, uint64_t index) {
+  return qf->values[get_slot_pool_index(qf, index)];
+}
+
+/* Overwrite the value of a slot, the slot itself is left alone. */
+static inline void set_slot_value(const QF *qf, uint64_t index,
+                                  uint64_t value) {
+  qf->values[get_slot_pool_index(qf, index)] = value & value_mask(qf);
+}
+
+/* Store `value` in a free pool entry. Return its index, or QF_POOL_NONE if
+ * the pool is full. Free entries are chained through their value words. */
+static inline uint64_t pool_alloc(QF *qf, uint64_t value) {
+  uint64_t pool_index = qf->metadata->pool_free;
+  if (pool_index != QF_POOL_NONE)
+    qf->metadata->pool_free = qf->values[pool_index];
+  else if (qf->metadata->pool_used < qf->metadata->xnslots)
+    pool_index = qf->metadata->pool_used++;
+  else
+    return QF_POOL_NONE;
+  qf->values[pool_index] = value & value_mask(qf);
+  return pool_index;
+}
+
+static inline void pool_release(QF *qf, uint64_t pool_index) {
+  qf->values[pool_index] = qf->metadata->pool_free;
+  qf->metadata->pool_free = pool_index;
+}
+
+#else
+
+static inline uint64_t value_mask(const QF *qf) {
+  return BITMASK(slot_data_bits(qf));
+}
+
+static inline uint64_t get_slot_value(const QF *qf, uint64_t index) {
+  return get_slot(qf, index) & value_mask(qf);
+}
+
+/* Overwrite the value bits of a slot in place, keeping its remainder. */
+static inline void set_slot_value(const QF *qf, uint64_t index,
+                                  uint64_t value) {
+  const uint64_t mask = value_mask(qf);
+  set_slot(qf, index, (get_slot(qf, index) & ~mask) | (value & mask));
+}
+
+#endif
+
+#ifdef QF_TTL
+
+/* Expiry time for an item living `ttl` ticks from now. 0 means never, so a
+ * time that wraps onto it expires one tick late. */
+static inline uint64_t ttl_expiry(const QF *qf, uint64_t ttl) {
+  const uint64_t expiry = (qf->metadata->clock + ttl) & BITMASK(QF_TTL_BITS);
+  return expiry ? expiry : 1;
+}
+
+/* The low value bits of a slot holding `data` (a value or a pool index) and
+ * `expiry` above it. */
+static inline uint64_t slot_value_with_expiry(const QF *qf, uint64_t data,
+                                              uint64_t expiry) {
+  return (expiry << slot_data_bits(qf)) | (data & BITMASK(slot_data_bits(qf)));
+}
+
+/* An item has expired once the clock reached its expiry time, comparing
+ * modulo 2^QF_TTL_BITS. TTLs must stay below half that range, and expired
+ * items must be reclaimed before the clock gets that far past them. */
+static inline bool is_slot_expired(const QF *qf, uint64_t index) {
+  const uint64_t expiry =
+      (get_slot(qf, index) >> slot_data_bits(qf)) & BITMASK(QF_TTL_BITS);
+  return expiry != 0 &&
+         ((qf->metadata->clock - expiry) & BITMASK(QF_TTL_BITS)) <
+             (1ULL << (QF_TTL_BITS - 1));
+}
+
+#endif
+
 static inline int offset_lower_bound(const QF *qf, uint64_t slot_index);
 static inline uint64_t run_end(const QF *qf, uint64_t hash_bucket_index);
 #ifdef _BLOCKOFFSET_4_NUM_RUNENDS
@@ -448,20 +697,41 @@ static void _recalculate_block_offsets(QF *qf, size_t run);
 #endif
 
 
+/* A stored offset of QF_MAX_OFFSET is an escape: the real offset is too big
+ * for the field and has to be recomputed from the metadata bits. */
 static inline uint64_t block_offset(const QF *qf, uint64_t blockidx) {
 #ifdef _BLOCKOFFSET_4_NUM_RUNENDS
-  return get_block(qf, blockidx)->offset;
+  uint64_t offset = get_block(qf, blockidx)->offset;
+  if (offset < QF_MAX_OFFSET)
+    return offset;
+  // Walk back to the closest block with an exact offset, then add up the
+  // runends that overflow each block in between.
+  uint64_t b = blockidx;
+  while (get_block(qf, b)->offset == QF_MAX_OFFSET) {
+    if (b == 0) {
+#ifdef QF_CIRCULAR
+      // Block 0 can be saturated by runs wrapping around, keep walking back
+      // from the end of the table.
+      b += qf->metadata->nblocks;
+      blockidx += qf->metadata->nblocks;
+#else
+      break;
+#endif
+    }
+    b--;
+  }
+  offset = get_block(qf, b)->offset;
+  for (; b < blockidx; b++) {
+    const qfblock *block = get_block(qf, b);
+    offset = offset + block_popcnt_occupieds(block) -
+             block_popcnt_runends(block);
+  }
+  return offset;
 #else
   if (blockidx == 0)
     return 0;
-  /* If we have extended counters and a 16-bit (or larger) offset
-           field, then we can safely ignore the possibility of overflowing
-           that field. */
-  if (sizeof(qf->blocks[0].offset) > 1 ||
-      get_block(qf, blockidx)->offset <
-          BITMASK(8 * sizeof(qf->blocks[0].offset)))
+  if (get_block(qf, blockidx)->offset < QF_MAX_OFFSET)
     return get_block(qf, blockidx)->offset;
-  else abort();
 
   return run_end(qf, QF_SLOTS_PER_BLOCK * blockidx - 1) -
          QF_SLOTS_PER_BLOCK * blockidx + 1;
@@ -524,11 +794,14 @@ static inline int offset_lower_bound(const QF *qf, uint64_t slot_index) {
   const qfblock *b = get_block(qf, block_id);
   const uint64_t slot_offset = slot_index % QF_SLOTS_PER_BLOCK;
   const uint64_t boffset = block_offset(qf, block_id);
-  const uint64_t occupieds = b->occupieds[0] & BITMASK(slot_offset + 1);
-  const uint64_t runends = b->runends[0] & BITMASK(slot_offset);
-  assert(QF_SLOTS_PER_BLOCK == 64);
+  const size_t word = slot_offset / 64;
+  const uint64_t occupieds = b->occupieds[word] & BITMASK(slot_offset % 64 + 1);
+  const uint64_t runends = b->runends[word] & BITMASK(slot_offset % 64);
 #ifdef _BLOCKOFFSET_4_NUM_RUNENDS
-  return popcnt(occupieds) + boffset - popcnt(runends);
+  int cnt = popcnt(occupieds) + boffset - popcnt(runends);
+  for (size_t i = 0; i < word; i++)  // Earlier words of a multi-word block.
+    cnt += popcnt(b->occupieds[i]) - popcnt(b->runends[i]);
+  return cnt;
 #else
   if (boffset <= slot_offset) {
     return popcnt(occupieds) - popcnt(runends >> boffset);
@@ -597,7 +870,7 @@ static inline void shift_remainders(QF *qf, uint64_t start_index,
   uint64_t start_offset = start_index % QF_SLOTS_PER_BLOCK;
   uint64_t empty_block = empty_index / QF_SLOTS_PER_BLOCK;
   uint64_t empty_offset = empty_index % QF_SLOTS_PER_BLOCK;
-#ifdef DEBUG
+#if defined(DEBUG) && !defined(QF_CIRCULAR)
   assert(start_index <= empty_index && empty_index < qf->metadata->xnslots);
 #endif
   while (start_block < empty_block) {
@@ -651,9 +924,12 @@ static inline void shift_remainders_left(QF *qf, uint64_t start_index,
 
 #else
 
+// A block holds bits_per_slot remainder words per 64 slots.
+#define REMAINDER_WORDS_PER_BLOCK(qf)                                          \
+  ((qf)->metadata->bits_per_slot * QF_METADATA_WORDS_PER_BLOCK)
 #define REMAINDER_WORD(qf, i)                                                  \
-  ((uint64_t *)&(get_block(qf, (i) / qf->metadata->bits_per_slot)              \
-                     ->slots[8 * ((i) % qf->metadata->bits_per_slot)]))
+  ((uint64_t *)&(get_block(qf, (i) / REMAINDER_WORDS_PER_BLOCK(qf))            \
+                     ->slots[8 * ((i) % REMAINDER_WORDS_PER_BLOCK(qf))]))
 
 /* shift slots in range [start_index, empty_index) by 1 to the big end. 
  * slot empty_index will be replaced by slot empty_index-1
@@ -720,7 +996,7 @@ static inline void qf_dump_block_long(const QF *qf, uint64_t i) {
 static inline void qf_dump_block(const QF *qf, uint64_t i) {
   uint64_t j;
 
-  printf("%-192d", get_block(qf, i)->offset);
+  printf("%-192lu", block_offset(qf, i));
   printf("\n");
 
   for (j = 0; j < QF_SLOTS_PER_BLOCK; j++)
@@ -904,8 +1180,13 @@ static inline uint64_t next_slot(QF *qf, uint64_t current) {
 /* Return the hash of the key. */
 static inline uint64_t key2hash(const QF *qf, const uint64_t key,
                                 const uint8_t flags) {
-  if (GET_KEY_HASH(flags) == QF_HASH_INVERTIBLE)
-    return hash_64(key, BITMASK(qf->metadata->key_bits));
+  if (GET_KEY_HASH(flags) != QF_KEY_IS_HASH) {
+    if (qf->metadata->hash_mode == QF_HASH_DEFAULT)
+      return MurmurHash64A_u64(key, qf->metadata->seed) &
+             BITMASK(qf->metadata->key_bits);
+    else if (qf->metadata->hash_mode == QF_HASH_INVERTIBLE)
+      return hash_64(key, BITMASK(qf->metadata->key_bits));
+  }
   return key & BITMASK(qf->metadata->key_bits);
 }
 
@@ -948,31 +1229,71 @@ static inline uint64_t bsf_from(const uint64_t val, int from)
 
 /* Return the start index of a run if it exists or where it should be. */
 static size_t run_start(const QF *const qf, const size_t quotient) {
-  if (quotient == 0) return 0;
+  if (quotient == 0) {
+#ifdef QF_CIRCULAR
+    // The last run of the table may have wrapped around into block 0.
+    const size_t last_end = run_end(qf, qf->metadata->nslots - 1);
+    if (last_end >= qf->metadata->nslots)
+      return last_end + 1 - qf->metadata->nslots;
+#endif
+    return 0;
+  }
   else return run_end(qf, quotient - 1) + 1;
 }
 
+/* Whether `index`, found by searching forward from `from`, is past the end
+ * of the table. In circular mode the search may wrap around once. */
+static inline bool past_table_end(const QF *qf, size_t from, size_t index) {
+#ifdef QF_CIRCULAR
+  return index >= from + qf->metadata->nslots;
+#else
+  return index >= qf->metadata->xnslots;
+#endif
+}
+
 
 /* Find next occupied in [run, nslots). Return nslots if no such one. */
 static size_t find_next_run(const QF *qf, size_t run) {
+  if (run >= qf->metadata->nslots)
+    return qf->metadata->xnslots;
   if (is_occupied(qf, run))
     return run;
-  size_t block_index = run / QF_SLOTS_PER_BLOCK;
-  size_t slot_offset = run % QF_SLOTS_PER_BLOCK;
-  slot_offset = bsf_from(get_block(qf, block_index)->occupieds[0], slot_offset);
-  while (slot_offset == QF_SLOTS_PER_BLOCK) {
-    ++block_index;
-    if (block_index * QF_SLOTS_PER_BLOCK >= qf->metadata->nslots)
+  size_t word_index = run / 64;
+  size_t slot_offset = bsf_from(METADATA_WORD(qf, occupieds, run), run % 64);
+  while (slot_offset == 64) {
+    ++word_index;
+    if (word_index * 64 >= qf->metadata->nslots)
       return qf->metadata->xnslots;
-    slot_offset = bsf_from(get_block(qf, block_index)->occupieds[0], 0);
+    slot_offset = bsf_from(METADATA_WORD(qf, occupieds, 64 * word_index), 0);
   }
-  return slot_offset + block_index * QF_SLOTS_PER_BLOCK;
+  return slot_offset + word_index * 64;
 }
 
 /* Update the block offsets of the following blocks.
  * Assume the current block offset is correct.
  */
 #ifdef _BLOCKOFFSET_4_NUM_RUNENDS
+#ifdef QF_CIRCULAR
+/* Recompute every block offset from scratch. Some slot is always free and
+ * no run crosses it, so the lowest run depth over the table must be 0. */
+static void _recalculate_all_block_offsets(QF *qf) {
+  const size_t nslots = qf->metadata->nslots;
+  int64_t depth = 0, lowest = 0;
+  for (size_t i = 0; i < nslots; i++) {
+    depth += is_occupied(qf, i);
+    lowest = MIN(lowest, depth);
+    depth -= is_runend(qf, i);
+  }
+  // depth is 0 again here, shift it so the free slots end up at 0.
+  depth = -lowest;
+  for (size_t b = 0; b < qf->metadata->nblocks; b++) {
+    qfblock *block = get_block(qf, b);
+    block->offset = MIN((uint64_t)depth, QF_MAX_OFFSET);
+    depth += block_popcnt_occupieds(block) - block_popcnt_runends(block);
+  }
+}
+#endif
+
 static void _recalculate_block_offsets(QF *qf, size_t from_index, size_t to_index) {
 /* If the block offset is the num of overflowed runends.
  * Assume the current block offset, recalculate the following block offsets
@@ -980,18 +1301,28 @@ static void _recalculate_block_offsets(QF *qf, size_t from_index, size_t to_inde
  */
   size_t from_b = from_index / QF_SLOTS_PER_BLOCK;
   size_t to_b = to_index / QF_SLOTS_PER_BLOCK;
+#ifdef QF_CIRCULAR
+  if (to_b - from_b >= qf->metadata->nblocks) {
+    // The change went a whole lap back into from_b, so its offset is stale
+    // as well and can't be the starting point.
+    _recalculate_all_block_offsets(qf);
+    return;
+  }
+#endif
   qfblock *block = get_block(qf, from_b);
-  size_t offset = block->offset;
+  size_t offset = block_offset(qf, from_b);
   while (from_b < to_b) {
     // calculate the next block offset
-    size_t n_occupieds = popcnt(block->occupieds[0]);
-    size_t n_runends = popcnt(block->runends[0]);
+    size_t n_occupieds = block_popcnt_occupieds(block);
+    size_t n_runends = block_popcnt_runends(block);
     offset = offset + n_occupieds - n_runends;
-    // update the next block offset
+    // update the next block offset, saturating to the escape value.
     block = get_block(qf, ++from_b);
-    block->offset = offset;
+    block->offset = MIN(offset, QF_MAX_OFFSET);
   }
+#ifndef QF_CIRCULAR
   assert(from_b < qf->metadata->nblocks);
+#endif
 }
 #else
 static void _recalculate_block_offsets(QF *qf, size_t index) {
@@ -1008,13 +1339,11 @@ static void _recalculate_block_offsets(QF *qf, size_t index) {
       next_offset = 0;
     } else { // if the last run spans across the block
       next_offset = block_runend_index - block_last_run;
-      // printf("block: %u, offset: %u\n", original_block, block_offset);
-      assert(next_offset < 255);
     }
     block_id++;
-    if (next_offset >= 255) {
-      printf("block: %lu, offset: %u\n", block_id, next_offset);
-      get_block(qf, block_id)->offset = 255;
+    if (next_offset >= QF_MAX_OFFSET) {
+      // Too big for the field, block_offset will recompute it from run_end.
+      get_block(qf, block_id)->offset = QF_MAX_OFFSET;
       continue;
     }
     if (block_offset(qf, block_id) == next_offset)
@@ -1028,35 +1357,37 @@ static void _recalculate_block_offsets(QF *qf, size_t index) {
 
 // Reset all tombstone bits from [from_index, to_index]
 static inline void reset_tombstone_block(QF *qf, size_t from_index, size_t to_index) {
-  size_t from_block, from_block_offset, target_index, block_end_index, block_end_offset, mask;
-  from_block = from_index / QF_SLOTS_PER_BLOCK;
-  block_end_index = MIN((from_block + 1)* QF_SLOTS_PER_BLOCK - 1, to_index);
+  size_t from_word, from_word_offset, target_index, word_end_index, word_end_offset, mask;
+  from_word = from_index / 64;
+  word_end_index = MIN((from_word + 1)* 64 - 1, to_index);
   while (true) {
-    block_end_offset = block_end_index % QF_SLOTS_PER_BLOCK;
-    from_block_offset = from_index % QF_SLOTS_PER_BLOCK;
-    mask = BITMASK(QF_SLOTS_PER_BLOCK) ^ (BITMASK(block_end_offset+1) ^ BITMASK(from_block_offset));
-    METADATA_WORD(qf, tombstones, block_end_index) &= mask;
-    from_index = block_end_index + 1;
+    word_end_offset = word_end_index % 64;
+    from_word_offset = from_index % 64;
+    mask = BITMASK(64) ^ (BITMASK(word_end_offset+1) ^ BITMASK(from_word_offset));
+    METADATA_WORD(qf, tombstones, word_end_index) &= mask;
+    SUMMARY_SYNC(qf, tombstone_summary, tombstones, word_end_index);
+    from_index = word_end_index + 1;
     if (from_index > to_index) break;
-    from_block++;
-    block_end_index = MIN((from_block + 1)* QF_SLOTS_PER_BLOCK - 1, to_index);
+    from_word++;
+    word_end_index = MIN((from_word + 1)* 64 - 1, to_index);
   }
 }
 
 // Set all tombstone bits from [from_index, to_index]
 static inline void set_tombstone_block(QF *qf, size_t from_index, size_t to_index) {
-  size_t from_block, from_block_offset, target_index, block_end_index, block_end_offset, mask;
-  from_block = from_index / QF_SLOTS_PER_BLOCK;
-  block_end_index = MIN((from_block + 1)* QF_SLOTS_PER_BLOCK - 1, to_index);
+  size_t from_word, from_word_offset, target_index, word_end_index, word_end_offset, mask;
+  from_word = from_index / 64;
+  word_end_index = MIN((from_word + 1)* 64 - 1, to_index);
   while (true) {
-    block_end_offset = block_end_index % QF_SLOTS_PER_BLOCK;
-    from_block_offset = from_index % QF_SLOTS_PER_BLOCK;
-    mask = (BITMASK(block_end_offset+1) ^ BITMASK(from_block_offset));
-    METADATA_WORD(qf, tombstones, block_end_index) |= mask;
-    from_index = block_end_index + 1;
+    word_end_offset = word_end_index % 64;
+    from_word_offset = from_index % 64;
+    mask = (BITMASK(word_end_offset+1) ^ BITMASK(from_word_offset));
+    METADATA_WORD(qf, tombstones, word_end_index) |= mask;
+    SUMMARY_MARK(qf, tombstone_summary, word_end_index);
+    from_index = word_end_index + 1;
     if (from_index > to_index) break;
-    from_block++;
-    block_end_index = MIN((from_block + 1)* QF_SLOTS_PER_BLOCK - 1, to_index);
+    from_word++;
+    word_end_index = MIN((from_word + 1)* 64 - 1, to_index);
   }
 }
 
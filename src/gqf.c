@@ -11,6 +11,10 @@
 #include <unistd.h>
 #include <time.h>
 #include <unistd.h>
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 #include "gqf.h"
 #include "hm.h"
@@ -56,6 +60,35 @@ void qf_dump_long(const QF *qf) {
  * Code that uses the above to implement key-value operations.               *
  *****************************************************************************/
 
+#ifdef QF_BLOCK_SUMMARY
+/* The summaries are stored after the blocks, aligned to 8 bytes. */
+static uint64_t qf_blocks_size(uint64_t nblocks, uint64_t bits_per_slot) {
+#if QF_BITS_PER_SLOT == 8 || QF_BITS_PER_SLOT == 16 ||                         \
+    QF_BITS_PER_SLOT == 32 || QF_BITS_PER_SLOT == 64
+  uint64_t size = nblocks * sizeof(qfblock);
+#else
+  uint64_t size = nblocks * (sizeof(qfblock) + QF_SLOTS_PER_BLOCK * bits_per_slot / 8);
+#endif
+  return (size + 7) & ~7ULL;
+}
+
+static void qf_attach_summaries(QF *qf) {
+  uint64_t nblocks = qf->metadata->nblocks;
+  qf->runend_summary = (uint64_t *)((char *)qf->blocks +
+                       qf_blocks_size(nblocks, qf->metadata->bits_per_slot));
+  qf->tombstone_summary = qf->runend_summary + QF_SUMMARY_WORDS(nblocks);
+}
+#endif
+
+#ifdef QF_VALUE_POOL
+/* The pool takes the last xnslots words of the buffer. */
+static void qf_attach_values(QF *qf) {
+  qf->values = (uint64_t *)((char *)qf->blocks +
+                            qf->metadata->total_size_in_bytes) -
+               qf->metadata->xnslots;
+}
+#endif
+
 /* TODO: If tombstone_space == 0 and/or nrebuilds == 0, automaticlly calculate
  * them based on current load factor when rebuiding. */
 uint64_t qf_init_advanced(QF *qf, uint64_t nslots, uint64_t key_bits,
@@ -72,7 +105,13 @@ uint64_t qf_init_advanced(QF *qf, uint64_t nslots, uint64_t key_bits,
 
   assert(popcnt(nslots) == 1); /* nslots must be a power of 2 */
   num_slots = nslots;
+#ifdef QF_CIRCULAR
+  // Runs wrap around to block 0, no overflow slots needed.
+  assert(nslots >= QF_SLOTS_PER_BLOCK);
+  xnslots = nslots;
+#else
   xnslots = nslots + 10 * sqrt((double)nslots);
+#endif
   nblocks = (xnslots + QF_SLOTS_PER_BLOCK - 1) / QF_SLOTS_PER_BLOCK;
   key_remainder_bits = key_bits;
   // set remainder_bits = key_bits - size_bits, where size_bits = log2(nslots)
@@ -83,6 +122,17 @@ uint64_t qf_init_advanced(QF *qf, uint64_t nslots, uint64_t key_bits,
   // TODO: Why?
   assert(key_remainder_bits >= 2);
 
+#ifdef QF_VALUE_POOL
+  // Slots hold an index into the pool instead of the value.
+  const uint64_t pool_value_bits = value_bits;
+  value_bits = 64 - __builtin_clzll(xnslots - 1);
+#endif
+#ifdef QF_TTL
+  value_bits += QF_TTL_BITS;
+#endif
+#ifdef QF_CACHE
+  value_bits += 1;
+#endif
   bits_per_slot = key_remainder_bits + value_bits;
   assert(QF_BITS_PER_SLOT == 0 ||
          QF_BITS_PER_SLOT == bits_per_slot);
@@ -93,6 +143,13 @@ uint64_t qf_init_advanced(QF *qf, uint64_t nslots, uint64_t key_bits,
 #else
   size = nblocks * (sizeof(qfblock) + QF_SLOTS_PER_BLOCK * bits_per_slot / 8);
 #endif
+#ifdef QF_BLOCK_SUMMARY
+  size = qf_blocks_size(nblocks, bits_per_slot) +
+         2 * QF_SUMMARY_WORDS(nblocks) * sizeof(uint64_t);
+#endif
+#ifdef QF_VALUE_POOL
+  size = ((size + 7) & ~7ULL) + xnslots * sizeof(uint64_t);
+#endif
 
   total_num_bytes = sizeof(qfmetadata) + size;
   if (buffer == NULL || total_num_bytes > buffer_len)
@@ -129,15 +186,27 @@ uint64_t qf_init_advanced(QF *qf, uint64_t nslots, uint64_t key_bits,
   // qf->metadata->next_tombstone = qf->metadata->tombstone_space;
   qf->metadata->nelts = 0;
   qf->metadata->noccupied_slots = 0;
+#ifdef QF_VALUE_POOL
+  qf->metadata->pool_value_bits = pool_value_bits;
+  qf->metadata->pool_free = QF_POOL_NONE;
+  qf->metadata->pool_used = 0;
+  qf_attach_values(qf);
+#endif
 
 #ifdef QF_TOMBSTONE
   // Set all tombstones
   qfblock *b;
   for (uint64_t i = 0; i < qf->metadata->nblocks; i++) {
     b = get_block(qf, i);
-    b->tombstones[0] = 0xffffffffffffffffULL;
+    for (uint64_t j = 0; j < QF_METADATA_WORDS_PER_BLOCK; j++)
+      b->tombstones[j] = 0xffffffffffffffffULL;
   }
 #endif
+#ifdef QF_BLOCK_SUMMARY
+  qf_attach_summaries(qf);
+  for (uint64_t i = 0; i < qf->metadata->nblocks; i++)
+    qf->tombstone_summary[i / 64] |= 1ULL << (i % 64);
+#endif
 
 
 
@@ -157,6 +226,12 @@ uint64_t qf_use(QF *qf, void *buffer, uint64_t buffer_len) {
     return qf->metadata->total_size_in_bytes + sizeof(qfmetadata);
   }
   qf->blocks = (qfblock *)(qf->metadata + 1);
+#ifdef QF_BLOCK_SUMMARY
+  qf_attach_summaries(qf);
+#endif
+#ifdef QF_VALUE_POOL
+  qf_attach_values(qf);
+#endif
 
   return sizeof(qfmetadata) + qf->metadata->total_size_in_bytes;
 }
@@ -218,6 +293,14 @@ bool qf_free(QF *qf) {
   return false;
 }
 
+uint64_t qf_count_key_value(const QF *qf, uint64_t key, uint64_t value,
+                            uint8_t flags) {
+  uint64_t stored_value;
+  if (hm_lookup(qf, key, &stored_value, flags) < 0)
+    return 0;
+  return stored_value == (value & value_mask(qf));
+}
+
 uint64_t qf_get_key_from_index(const QF *qf, const size_t index) {
   return get_slot(qf, index) >> qf->metadata->value_bits;
 }
@@ -225,8 +308,7 @@ uint64_t qf_get_key_from_index(const QF *qf, const size_t index) {
 
 int64_t qf_get_unique_index(const QF *qf, uint64_t key, uint64_t value,
                             uint8_t flags) {
-  if (GET_KEY_HASH(flags) == QF_HASH_INVERTIBLE)
-    key = hash_64(key, BITMASK(qf->metadata->key_bits));
+  key = key2hash(qf, key, flags);
 
   uint64_t hash = (key << qf->metadata->value_bits) |
                   (value & BITMASK(qf->metadata->value_bits));
@@ -236,8 +318,7 @@ int64_t qf_get_unique_index(const QF *qf, uint64_t key, uint64_t value,
   if (!is_occupied(qf, hash_bucket_index))
     return QF_DOESNT_EXIST;
 
-  int64_t runstart_index =
-      hash_bucket_index == 0 ? 0 : run_end(qf, hash_bucket_index - 1) + 1;
+  int64_t runstart_index = run_start(qf, hash_bucket_index);
   if (runstart_index < hash_bucket_index)
     runstart_index = hash_bucket_index;
 
@@ -267,6 +348,23 @@ uint64_t qf_get_total_size_in_bytes(const QF *qf) {
   return qf->metadata->total_size_in_bytes;
 }
 
+/* Move the iterator off a tombstone to the next item of its run. */
+static inline void qfi_skip_tombstones(QFi *qfi) {
+#ifdef QF_TOMBSTONE
+  if (!qfi_end(qfi) && is_tombstone(qfi->qf, qfi->current))
+    qfi->current = find_next_item(qfi->qf, qfi->current);
+#endif
+}
+
+/* Position a new iterator on a live item. */
+static inline void qfi_settle(QFi *qfi) {
+  qfi_skip_tombstones(qfi);
+#ifdef QF_TTL
+  if (!qfi_end(qfi) && is_slot_expired(qfi->qf, qfi->current))
+    qfi_next(qfi);
+#endif
+}
+
 /* initialize the iterator at the run corresponding
  * to the position index
  */
@@ -277,24 +375,19 @@ int64_t qf_iterator_from_position(const QF *qf, QFi *qfi, uint64_t position) {
     return QFI_INVALID;
   }
   assert(position < qf->metadata->nslots);
-  if (!is_occupied(qf, position)) {
-    uint64_t block_index = position;
-    uint64_t idx = bitselect(get_block(qf, block_index)->occupieds[0], 0);
-    if (idx == 64) {
-      while (idx == 64 && block_index < qf->metadata->nblocks) {
-        block_index++;
-        idx = bitselect(get_block(qf, block_index)->occupieds[0], 0);
-      }
-    }
-    position = block_index * QF_SLOTS_PER_BLOCK + idx;
-  }
-
   qfi->qf = qf;
   qfi->num_clusters = 0;
+  position = find_next_run(qf, position);
+  if (position >= qf->metadata->nslots) {
+    qfi->run = qfi->current = qf->metadata->xnslots;
+    return QFI_INVALID;
+  }
+
   qfi->run = position;
-  qfi->current = position == 0 ? 0 : run_end(qfi->qf, position - 1) + 1;
+  qfi->current = run_start(qfi->qf, position);
   if (qfi->current < position)
     qfi->current = position;
+  qfi_settle(qfi);
 
 #ifdef LOG_CLUSTER_LENGTH
   qfi->c_info =
@@ -307,7 +400,11 @@ int64_t qf_iterator_from_position(const QF *qf, QFi *qfi, uint64_t position) {
   qfi->cur_length = 1;
 #endif
 
+#ifdef QF_CIRCULAR
+  if (qfi->run >= qf->metadata->nslots)
+#else
   if (qfi->current >= qf->metadata->nslots)
+#endif
     return QFI_INVALID;
   return qfi->current;
 }
@@ -323,8 +420,7 @@ int64_t qf_iterator_from_key_value(const QF *qf, QFi *qfi, uint64_t key,
   qfi->qf = qf;
   qfi->num_clusters = 0;
 
-  if (GET_KEY_HASH(flags) == QF_HASH_INVERTIBLE)
-    key = hash_64(key, BITMASK(qf->metadata->key_bits));
+  key = key2hash(qf, key, flags);
 
   uint64_t hash = (key << qf->metadata->value_bits) |
                   (value & BITMASK(qf->metadata->value_bits));
@@ -336,14 +432,19 @@ int64_t qf_iterator_from_key_value(const QF *qf, QFi *qfi, uint64_t key,
   // If a run starts at "position" move the iterator to point it to the
   // smallest key greater than or equal to "hash".
   if (is_occupied(qf, hash_bucket_index)) {
-    uint64_t runstart_index =
-        hash_bucket_index == 0 ? 0 : run_end(qf, hash_bucket_index - 1) + 1;
+    uint64_t runstart_index = run_start(qf, hash_bucket_index);
     if (runstart_index < hash_bucket_index)
       runstart_index = hash_bucket_index;
     uint64_t current_remainder, current_end;
     do {
       current_end = runstart_index;
       current_remainder = get_slot(qf, current_end);
+#ifdef QF_TOMBSTONE
+      if (is_tombstone(qf, current_end)) {
+        runstart_index = current_end + 1;
+        continue;
+      }
+#endif
       if (current_remainder >= hash_remainder) {
         flag = true;
         break;
@@ -360,35 +461,40 @@ int64_t qf_iterator_from_key_value(const QF *qf, QFi *qfi, uint64_t key,
   // starting at "position" is smaller than "hash" then find the start of the
   // next run.
   if (!is_occupied(qf, hash_bucket_index) || !flag) {
-    uint64_t position = hash_bucket_index;
-    assert(position < qf->metadata->nslots);
-    uint64_t block_index = position / QF_SLOTS_PER_BLOCK;
-    uint64_t idx = bitselect(get_block(qf, block_index)->occupieds[0], 0);
-    if (idx == 64) {
-      while (idx == 64 && block_index < qf->metadata->nblocks) {
-        block_index++;
-        idx = bitselect(get_block(qf, block_index)->occupieds[0], 0);
-      }
+    assert(hash_bucket_index < qf->metadata->nslots);
+    uint64_t position = find_next_run(qf, hash_bucket_index + 1);
+    if (position >= qf->metadata->nslots) {
+      qfi->run = qfi->current = qf->metadata->xnslots;
+      return QFI_INVALID;
     }
-    position = block_index * QF_SLOTS_PER_BLOCK + idx;
     qfi->run = position;
-    qfi->current = position == 0 ? 0 : run_end(qfi->qf, position - 1) + 1;
+    qfi->current = run_start(qfi->qf, position);
     if (qfi->current < position)
       qfi->current = position;
   }
+  qfi_settle(qfi);
 
+#ifdef QF_CIRCULAR
+  if (qfi->run >= qf->metadata->nslots)
+#else
   if (qfi->current >= qf->metadata->nslots)
+#endif
     return QFI_INVALID;
   return qfi->current;
 }
 
+int64_t qf_iterator_from_key(const QF *qf, QFi *qfi, uint64_t key,
+                             uint8_t flags) {
+  return qf_iterator_from_key_value(qf, qfi, key, 0, flags);
+}
+
 static int qfi_get(const QFi *qfi, uint64_t *key, uint64_t *value) {
   if (qfi_end(qfi))
     return QFI_INVALID;
 
   uint64_t current_remainder = get_slot(qfi->qf, qfi->current);
 
-  *value = current_remainder & BITMASK(qfi->qf->metadata->value_bits);
+  *value = get_slot_value(qfi->qf, qfi->current);
   current_remainder = current_remainder >> qfi->qf->metadata->value_bits;
   *key =
       (qfi->run << qfi->qf->metadata->key_remainder_bits) | current_remainder;
@@ -412,7 +518,7 @@ int qfi_get_hash(const QFi *qfi, uint64_t *key, uint64_t *value) {
   return qfi_get(qfi, key, value);
 }
 
-int qfi_next(QFi *qfi) {
+static int qfi_step(QFi *qfi) {
   if (qfi_end(qfi))
     return QFI_INVALID;
   else {
@@ -423,31 +529,30 @@ int qfi_next(QFi *qfi) {
 #endif
       if (qfi_end(qfi))
         return QFI_INVALID;
+      qfi_skip_tombstones(qfi);
       return 0;
     } else {
 #ifdef LOG_CLUSTER_LENGTH
       /* save to check if the new current is the new cluster. */
       uint64_t old_current = qfi->current;
 #endif
-      uint64_t block_index = qfi->run / QF_SLOTS_PER_BLOCK;
-      uint64_t rank = bitrank(get_block(qfi->qf, block_index)->occupieds[0],
-                              qfi->run % QF_SLOTS_PER_BLOCK);
+      const uint64_t nwords =
+          qfi->qf->metadata->nblocks * QF_METADATA_WORDS_PER_BLOCK;
+      uint64_t word_index = qfi->run / 64;
+      uint64_t rank = bitrank(METADATA_WORD(qfi->qf, occupieds, qfi->run),
+                              qfi->run % 64);
+      // rank is 64 when the word is fully occupied, bitselectv handles it.
       uint64_t next_run =
-          bitselect(get_block(qfi->qf, block_index)->occupieds[0], rank);
-      if (next_run == 64) {
-        rank = 0;
-        while (next_run == 64 && block_index < qfi->qf->metadata->nblocks) {
-          block_index++;
-          next_run =
-              bitselect(get_block(qfi->qf, block_index)->occupieds[0], rank);
-        }
-      }
-      if (block_index == qfi->qf->metadata->nblocks) {
+          bitselectv(METADATA_WORD(qfi->qf, occupieds, qfi->run), 0, rank);
+      while (next_run == 64 && ++word_index < nwords)
+        next_run =
+            bitselect(METADATA_WORD(qfi->qf, occupieds, 64 * word_index), 0);
+      if (word_index >= nwords) {
         /* set the index values to max. */
         qfi->run = qfi->current = qfi->qf->metadata->xnslots;
         return QFI_INVALID;
       }
-      qfi->run = block_index * QF_SLOTS_PER_BLOCK + next_run;
+      qfi->run = word_index * 64 + next_run;
       qfi->current++;
       if (qfi->current < qfi->run)
         qfi->current = qfi->run;
@@ -464,52 +569,375 @@ int qfi_next(QFi *qfi) {
         qfi->cur_length++;
       }
 #endif
+      qfi_skip_tombstones(qfi);
       return 0;
     }
   }
 }
 
+int qfi_next(QFi *qfi) {
+  int ret = qfi_step(qfi);
+#ifdef QF_TTL
+  // Expired items are dead until a rebuild window reclaims them.
+  while (ret == 0 && is_slot_expired(qfi->qf, qfi->current))
+    ret = qfi_step(qfi);
+#endif
+  return ret;
+}
+
+size_t qfi_next_batch(QFi *qfi, uint64_t *__restrict hashes,
+                      uint64_t *__restrict values, size_t max) {
+  if (qfi_end(qfi))
+    return 0;
+  const QF *qf = qfi->qf;
+  const uint64_t nwords = qf->metadata->nblocks * QF_METADATA_WORDS_PER_BLOCK;
+  const uint64_t remainder_bits = qf->metadata->key_remainder_bits;
+  const uint64_t value_bits = qf->metadata->value_bits;
+  uint64_t run = qfi->run, i = qfi->current;
+  size_t n = 0;
+  // Decode a metadata word at a time: its slots are visited in order and the
+  // runends say when to move on to the next occupied quotient.
+  for (;;) {
+    const uint64_t base = i & ~63ULL;
+    const uint64_t runends = METADATA_WORD(qf, runends, i);
+#ifdef QF_TOMBSTONE
+    uint64_t pending = ~METADATA_WORD(qf, tombstones, i);
+#else
+    uint64_t pending = ~0ULL;
+#endif
+    pending &= ~BITMASK(i % 64);
+    while (pending) {
+      const uint64_t bit = bitscanforward(pending);
+      i = base + bit;
+#ifdef QF_TTL
+      if (!is_slot_expired(qf, i)) {
+#endif
+        if (n == max) {
+          // Stop on the next item, as qfi_next would.
+          qfi->run = run;
+          qfi->current = i;
+          return n;
+        }
+        hashes[n] = (run << remainder_bits) | (get_slot(qf, i) >> value_bits);
+        values[n] = get_slot_value(qf, i);
+        n++;
+#ifdef QF_TTL
+      }
+#endif
+      pending &= pending - 1;
+      if (!((runends >> bit) & 1))
+        continue;
+      // The next run belongs to the next occupied quotient.
+      uint64_t word_index = run / 64;
+      uint64_t word =
+          METADATA_WORD(qf, occupieds, run) & ~BITMASK(run % 64 + 1);
+      while (word == 0) {
+        if (++word_index >= nwords) {
+          qfi->run = qfi->current = qf->metadata->xnslots;
+          return n;
+        }
+        word = METADATA_WORD(qf, occupieds, 64 * word_index);
+      }
+      run = word_index * 64 + bitscanforward(word);
+      // Past the end of a cluster the next run starts at its quotient.
+      if (run > i + 1) {
+        i = run;
+        if (i >= base + 64)
+          break;
+        pending &= ~BITMASK(i % 64);
+      }
+    }
+    if (i < base + 64)
+      i = base + 64;
+  }
+}
+
 bool qfi_end(const QFi *qfi) {
+#ifdef QF_CIRCULAR
+  // The last runs may wrap around, so current can go past the end.
+  if (qfi->run >= qfi->qf->metadata->nslots)
+    return true;
+#else
   if (qfi->current >=
       qfi->qf->metadata->xnslots /*&& is_runend(qfi->qf, qfi->current)*/)
     return true;
+#endif
   return false;
 }
 
-// We don't introduce tombstones in join_bench, so QFi doesn't need to be changed.
-void qf_join(const QF *qfa, const QF *qfb, QF *qfc)
-{
-    uint64_t count = 0;
-    QFi qfia, qfib;
-    qf_iterator_from_position(qfa, &qfia, 0);
-    qf_iterator_from_position(qfb, &qfib, 0);
-
-    if (qfa->metadata->hash_mode != qfc->metadata->hash_mode &&
-            qfa->metadata->seed != qfc->metadata->seed &&
-            qfb->metadata->hash_mode  != qfc->metadata->hash_mode &&
-            qfb->metadata->seed  != qfc->metadata->seed) {
-        fprintf(stderr, "Output QF and input QFs do not have the same hash mode or seed.\n");
-        exit(1);
+/* Which items of a merge go to the output: keys only in qfa, only in qfb,
+ * or in both (with the value of qfa). */
+#define QF_MERGE_A_ONLY (0x01)
+#define QF_MERGE_B_ONLY (0x02)
+#define QF_MERGE_BOTH (0x04)
+
+static uint8_t qf_merge_outputs(enum qf_set_op op) {
+  switch (op) {
+  case QF_INTERSECTION:
+    return QF_MERGE_BOTH;
+  case QF_UNION:
+    return QF_MERGE_A_ONLY | QF_MERGE_B_ONLY | QF_MERGE_BOTH;
+  case QF_DIFFERENCE:
+    return QF_MERGE_A_ONLY;
+  case QF_SYMMETRIC_DIFFERENCE:
+    return QF_MERGE_A_ONLY | QF_MERGE_B_ONLY;
+  }
+  return 0;
+}
+
+/* One side of a merge, read a batch at a time. Under UNORDERED the items of
+ * a run aren't sorted, so a batch only hands out whole runs, sorted by hash:
+ * the run it ends in waits for the next refill, and a run longer than the
+ * buffer grows it. */
+struct qf_merge_cursor {
+  QFi qfi;
+#ifdef UNORDERED
+  std::vector<uint64_t> hashes, values;
+  size_t filled;
+#else
+  uint64_t hashes[QF_JOIN_BATCH], values[QF_JOIN_BATCH];
+#endif
+  size_t i, n;
+};
+
+static size_t qf_merge_fill(qf_merge_cursor *c) {
+  c->i = 0;
+#ifdef UNORDERED
+  const size_t kept = c->filled - c->n;
+  memmove(c->hashes.data(), c->hashes.data() + c->n, kept * sizeof(uint64_t));
+  memmove(c->values.data(), c->values.data() + c->n, kept * sizeof(uint64_t));
+  c->filled = kept + qfi_next_batch(&c->qfi, c->hashes.data() + kept,
+                                    c->values.data() + kept,
+                                    c->hashes.size() - kept);
+  c->n = c->filled;
+  const uint64_t shift = c->qfi.qf->metadata->key_remainder_bits;
+  while (c->filled > 0 && !qfi_end(&c->qfi)) {
+    const uint64_t last = c->hashes[c->filled - 1] >> shift;
+    while (c->n > 0 && (c->hashes[c->n - 1] >> shift) == last)
+      c->n--;
+    if (c->n > 0)
+      break;
+    // The whole buffer is one run, read the rest of it.
+    const size_t size = c->hashes.size();
+    c->hashes.resize(2 * size);
+    c->values.resize(2 * size);
+    c->filled += qfi_next_batch(&c->qfi, c->hashes.data() + c->filled,
+                                c->values.data() + c->filled, size);
+    c->n = c->filled;
+  }
+  // Quotients are already in order, so this only sorts within runs.
+  for (size_t j = 1; j < c->n; j++) {
+    const uint64_t hash = c->hashes[j], value = c->values[j];
+    size_t k = j;
+    for (; k > 0 && c->hashes[k - 1] > hash; k--) {
+      c->hashes[k] = c->hashes[k - 1];
+      c->values[k] = c->values[k - 1];
+    }
+    c->hashes[k] = hash;
+    c->values[k] = value;
+  }
+#else
+  c->n = qfi_next_batch(&c->qfi, c->hashes, c->values, QF_JOIN_BATCH);
+#endif
+  return c->n;
+}
+
+/* Position the cursor at the first item whose hash has its top `range_bits`
+ * bits at or after `from`, at a quotient rebased to the size of the table. */
+static void qf_merge_start(const QF *qf, qf_merge_cursor *c,
+                           uint64_t range_bits, uint64_t from) {
+  c->i = c->n = 0;
+#ifdef UNORDERED
+  c->hashes.resize(QF_JOIN_BATCH);
+  c->values.resize(QF_JOIN_BATCH);
+  c->filled = 0;
+#endif
+  if (qf_iterator_from_position(
+          qf, &c->qfi,
+          from << (qf->metadata->key_bits - qf->metadata->key_remainder_bits -
+                   range_bits)) >= 0)
+    qf_merge_fill(c);
+}
+
+/* Merge the items of qfa and qfb whose hashes have their top `range_bits`
+ * bits in [from, until), passing the ones `outputs` selects to
+ * emit(kind, hash, value_a, value_b), in hash order, where kind is the
+ * QF_MERGE_* case the key falls in. The value of the side a key is missing
+ * from is 0. Both tables are ordered by the full hash, whatever their
+ * size, so a range can be merged on its own. */
+template <typename Emit>
+static void qf_merge_range(const QF *qfa, const QF *qfb, uint8_t outputs,
+                           uint64_t range_bits, uint64_t from, uint64_t until,
+                           Emit emit) {
+  const uint64_t range_shift = qfa->metadata->key_bits - range_bits;
+  qf_merge_cursor a, b;
+  qf_merge_start(qfa, &a, range_bits, from);
+  qf_merge_start(qfb, &b, range_bits, from);
+
+  for (;;) {
+    const bool in_a = a.i < a.n && (a.hashes[a.i] >> range_shift) < until;
+    const bool in_b = b.i < b.n && (b.hashes[b.i] >> range_shift) < until;
+    // Stop once the rest of the range can't produce output.
+    if ((!in_a || !(outputs & QF_MERGE_A_ONLY)) &&
+        (!in_b || !(outputs & QF_MERGE_B_ONLY)) &&
+        (!in_a || !in_b))
+      break;
+    if (in_a && (!in_b || a.hashes[a.i] < b.hashes[b.i])) {
+      if (outputs & QF_MERGE_A_ONLY)
+        emit(QF_MERGE_A_ONLY, a.hashes[a.i], a.values[a.i], 0);
+      a.i++;
+    } else if (!in_a || a.hashes[a.i] > b.hashes[b.i]) {
+      if (outputs & QF_MERGE_B_ONLY)
+        emit(QF_MERGE_B_ONLY, b.hashes[b.i], 0, b.values[b.i]);
+      b.i++;
+    } else {
+      if (outputs & QF_MERGE_BOTH)
+        emit(QF_MERGE_BOTH, a.hashes[a.i], a.values[a.i], b.values[b.i]);
+      a.i++;
+      b.i++;
     }
+    if (a.i == a.n && a.n > 0)
+      qf_merge_fill(&a);
+    if (b.i == b.n && b.n > 0)
+      qf_merge_fill(&b);
+  }
+}
 
-    uint64_t keya, valuea, keyb, valueb;
-    qfi_get_hash(&qfia, &keya, &valuea);
-    qfi_get_hash(&qfib, &keyb, &valueb);
-    printf("%ld %ld\n", keya, keyb);
-    do {
-        if (keya < keyb) {
-            qfi_next(&qfia);
-            qfi_get_hash(&qfia, &keya, &valuea);
-        } else if(keya == keyb) {
-            hm_insert(qfc, keya, valuea, QF_NO_LOCK | QF_KEY_IS_HASH);
-            qfi_next(&qfia);
-            qfi_get_hash(&qfia, &keya, &valuea);
-            count++;
-				} else {
-            qfi_next(&qfib);
-            qfi_get_hash(&qfib, &keyb, &valueb);
-        }
-    } while(!qfi_end(&qfia) && !qfi_end(&qfib));
-    printf("GZHM CommonKeys: %ld\n", count);
+/* Tables can be merged when their hashes are the same function of the key. */
+static bool qf_same_hash(const QF *qfa, const QF *qfb) {
+  return qfa->metadata->hash_mode == qfb->metadata->hash_mode &&
+         qfa->metadata->seed == qfb->metadata->seed &&
+         qfa->metadata->key_bits == qfb->metadata->key_bits;
+}
+
+int64_t qf_merge_parallel(const QF *qfa, const QF *qfb, QF *qfc,
+                          enum qf_set_op op, uint32_t nthreads) {
+  if (!qf_same_hash(qfa, qfb) || !qf_same_hash(qfa, qfc))
+    return QF_INVALID;
+  if (nthreads == 0)
+    nthreads = 1;
+  const uint8_t outputs = qf_merge_outputs(op);
+
+  // Each thread merges a slice of the quotients of the smaller table and
+  // hands its output to qfc a batch at a time, so memory doesn't grow with
+  // the result. Inserts shift slots across the slice boundaries and may
+  // start a rebuild window anywhere, so the batches are inserted one at a
+  // time, while the other threads keep merging.
+  const uint64_t range_bits =
+      qfa->metadata->key_bits - std::max(qfa->metadata->key_remainder_bits,
+                                         qfb->metadata->key_remainder_bits);
+  const uint64_t nranges = 1ULL << range_bits;
+  std::mutex insert_lock;
+  int error = 0;
+  std::vector<int64_t> counts(nthreads);
+  auto merge = [&](uint32_t t) {
+    uint64_t hashes[QF_JOIN_BATCH], values[QF_JOIN_BATCH];
+    size_t n = 0;
+    auto flush = [&]() {
+      std::lock_guard<std::mutex> guard(insert_lock);
+      for (size_t i = 0; i < n && error == 0; i++) {
+        if (hm_insert(qfc, hashes[i], values[i],
+                      QF_NO_LOCK | QF_KEY_IS_HASH) == QF_NO_SPACE)
+          error = QF_NO_SPACE;
+      }
+      counts[t] += n;
+      n = 0;
+    };
+    qf_merge_range(qfa, qfb, outputs, range_bits, nranges * t / nthreads,
+                   nranges * (t + 1) / nthreads,
+                   [&](uint8_t kind, uint64_t hash, uint64_t value_a,
+                       uint64_t value_b) {
+                     hashes[n] = hash;
+                     values[n] = kind == QF_MERGE_B_ONLY ? value_b : value_a;
+                     if (++n == QF_JOIN_BATCH)
+                       flush();
+                   });
+    if (n > 0)
+      flush();
+  };
+  std::vector<std::thread> threads;
+  for (uint32_t t = 1; t < nthreads; t++)
+    threads.emplace_back(merge, t);
+  merge(0);
+  for (auto &thread : threads)
+    thread.join();
+
+  if (error != 0)
+    return error;
+  int64_t count = 0;
+  for (uint32_t t = 0; t < nthreads; t++)
+    count += counts[t];
+  return count;
+}
+
+int64_t qf_join_stream(const QF *qfa, const QF *qfb, uint32_t nthreads,
+                       qf_join_callback callback, void *arg) {
+  if (!qf_same_hash(qfa, qfb))
+    return QF_INVALID;
+  if (nthreads == 0)
+    nthreads = 1;
+  const bool invertible = qfa->metadata->hash_mode == QF_HASH_INVERTIBLE;
+  const uint64_t key_mask = BITMASK(qfa->metadata->key_bits);
+  const uint64_t range_bits =
+      qfa->metadata->key_bits - std::max(qfa->metadata->key_remainder_bits,
+                                         qfb->metadata->key_remainder_bits);
+  const uint64_t nranges = 1ULL << range_bits;
+
+  // Each thread fills one batch of tuples and hands it over when it is full,
+  // so memory doesn't grow with the number of matches.
+  std::vector<uint64_t> counts(nthreads);
+  auto join = [&](uint32_t t) {
+    uint64_t keys[QF_JOIN_BATCH], values_a[QF_JOIN_BATCH],
+        values_b[QF_JOIN_BATCH];
+    size_t n = 0;
+    qf_merge_range(qfa, qfb, QF_MERGE_BOTH, range_bits,
+                   nranges * t / nthreads, nranges * (t + 1) / nthreads,
+                   [&](uint8_t, uint64_t hash, uint64_t value_a,
+                       uint64_t value_b) {
+                     keys[n] = invertible ? hash_64i(hash, key_mask) : hash;
+                     values_a[n] = value_a;
+                     values_b[n] = value_b;
+                     if (++n == QF_JOIN_BATCH) {
+                       callback(keys, values_a, values_b, n, t, arg);
+                       counts[t] += n;
+                       n = 0;
+                     }
+                   });
+    if (n > 0)
+      callback(keys, values_a, values_b, n, t, arg);
+    counts[t] += n;
+  };
+  std::vector<std::thread> threads;
+  for (uint32_t t = 1; t < nthreads; t++)
+    threads.emplace_back(join, t);
+  join(0);
+  for (auto &thread : threads)
+    thread.join();
+
+  int64_t count = 0;
+  for (uint32_t t = 0; t < nthreads; t++)
+    count += counts[t];
+  return count;
+}
+
+int64_t qf_join_parallel(const QF *qfa, const QF *qfb, QF *qfc,
+                         uint32_t nthreads) {
+  return qf_merge_parallel(qfa, qfb, qfc, QF_INTERSECTION, nthreads);
+}
+
+int64_t qf_join(const QF *qfa, const QF *qfb, QF *qfc) {
+  return qf_merge_parallel(qfa, qfb, qfc, QF_INTERSECTION, 1);
+}
+
+int64_t qf_union(const QF *qfa, const QF *qfb, QF *qfc) {
+  return qf_merge_parallel(qfa, qfb, qfc, QF_UNION, 1);
+}
+
+int64_t qf_difference(const QF *qfa, const QF *qfb, QF *qfc) {
+  return qf_merge_parallel(qfa, qfb, qfc, QF_DIFFERENCE, 1);
+}
+
+int64_t qf_symdiff(const QF *qfa, const QF *qfb, QF *qfc) {
+  return qf_merge_parallel(qfa, qfb, qfc, QF_SYMMETRIC_DIFFERENCE, 1);
 }
 
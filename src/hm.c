@@ -2,7 +2,9 @@
 #include "hm.h"
 #include <algorithm>
 #include <string>
+#include <thread>
 #include <unordered_map>
+#include <vector>
 
 #ifdef QF_TOMBSTONE
 #include "qft.h"
@@ -12,6 +14,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 uint64_t hm_init(HM *hm, uint64_t nslots, uint64_t key_bits,
                   uint64_t value_bits, enum qf_hashmode hash, uint32_t seed,
@@ -26,6 +29,9 @@ bool hm_malloc(HM *hm, uint64_t nslots, uint64_t key_bits,
   int ret = qf_malloc(hm, nslots, key_bits, value_bits, hash, seed, max_load_factor);
 #ifdef QF_TOMBSTONE
   reset_rebuild_cd(hm);
+#endif
+#ifdef QF_CACHE
+  hm->metadata->cache_capacity = nslots * max_load_factor;
 #endif
   return ret;
 }
@@ -39,6 +45,7 @@ bool hm_free(HM *hm) {
 }
 
 int hm_rebuild(HM *hm, uint8_t flags) {
+  hm->metadata->epoch++;
 #ifdef QF_TOMBSTONE
     qft_rebuild(hm, flags);
     return 0;
@@ -47,8 +54,7 @@ int hm_rebuild(HM *hm, uint8_t flags) {
 #endif
 }
 
-int hm_insert(HM *hm, uint64_t key, uint64_t value, uint8_t flags) {
-
+static int _hm_insert(HM *hm, uint64_t key, uint64_t value, uint8_t flags) {
 #ifdef QF_TOMBSTONE
   int ret = qft_insert(hm, key, value, flags);
   if (ret == QF_KEY_EXISTS) return ret;
@@ -87,7 +93,86 @@ int hm_insert(HM *hm, uint64_t key, uint64_t value, uint8_t flags) {
 #endif
 }
 
+/* Insert `key` with `value`, expiring at `expiry` under QF_TTL. */
+static int hm_insert_expiry(HM *hm, uint64_t key, uint64_t value,
+                            uint64_t expiry, uint8_t flags) {
+  hm->metadata->epoch++;
+#ifdef QF_VALUE_POOL
+  const uint64_t pool_index = pool_alloc(hm, value);
+  if (pool_index == QF_POOL_NONE)
+    return QF_NO_SPACE;
+  value = pool_index;
+#endif
+#ifdef QF_TTL
+  value = slot_value_with_expiry(hm, value, expiry);
+#endif
+#ifdef QF_CACHE
+  // New items get one pass of the eviction scan before they can go.
+  value |= slot_reference_bit(hm);
+#endif
+  int ret = _hm_insert(hm, key, value, flags);
+#ifdef QF_VALUE_POOL
+  if (ret < 0)
+    pool_release(hm, pool_index);
+#endif
+  return ret;
+}
+
+int hm_insert(HM *hm, uint64_t key, uint64_t value, uint8_t flags) {
+  return hm_insert_expiry(hm, key, value, 0, flags);
+}
+
+#ifdef QF_TTL
+int hm_insert_ttl(HM *hm, uint64_t key, uint64_t value, uint64_t ttl,
+                  uint8_t flags) {
+  return hm_insert_expiry(hm, key, value, ttl_expiry(hm, ttl), flags);
+}
+
+void hm_set_clock(HM *hm, uint64_t now) {
+  hm->metadata->clock = now;
+  // Items may have expired under a handle that is otherwise still good.
+  hm->metadata->epoch++;
+}
+#endif
+
+/* Find the slot holding `key`, so its value can be changed in place. */
+static inline int hm_find_key(const HM *hm, uint64_t key, uint8_t flags,
+                              qfposition *pos) {
+#ifdef QF_TOMBSTONE
+  return qft_find_key(hm, key, flags, pos);
+#else
+  return qf_find_key(hm, key, flags, pos);
+#endif
+}
+
+/* Remove the item at a position found by hm_find_key. */
+static inline int hm_remove_at(HM *hm, const qfposition *pos) {
+  hm->metadata->epoch++;
+#ifdef QF_VALUE_POOL
+  pool_release(hm, get_slot_pool_index(hm, pos->index));
+#endif
+#ifdef QF_TOMBSTONE
+#if DELETE_AND_PUSH
+  return _qft_remove_push_at(hm, pos->quotient, pos->index, pos->run_start,
+                             pos->run_end);
+#else
+  return _qft_remove_at(hm, pos->quotient, pos->index, pos->run_start,
+                        pos->run_end);
+#endif
+#else
+  return _qf_remove_at(hm, pos->quotient, pos->run_start, pos->index);
+#endif
+}
+
 int hm_remove(HM *hm, uint64_t key, uint8_t flags) {
+#ifdef QF_VALUE_POOL
+  // The pool entry of the key has to be found before its slot goes away.
+  qfposition pos;
+  if (!hm_find_key(hm, key, flags, &pos))
+    return QF_DOESNT_EXIST;
+  return hm_remove_at(hm, &pos);
+#else
+  hm->metadata->epoch++;
 #ifdef QF_TOMBSTONE
 #if DELETE_AND_PUSH
   return qft_remove_push(hm, key, flags);
@@ -97,6 +182,314 @@ int hm_remove(HM *hm, uint64_t key, uint8_t flags) {
 #else
   return qf_remove(hm, key, flags);
 #endif
+#endif
+}
+
+#ifdef QF_CACHE
+/* Evict an item from the runs of `quotient` on, the runs an insert there
+ * shifts. Referenced items have their bit cleared and are passed over;
+ * after QF_CACHE_SCAN of them the first one goes.
+ * Return 0 or more on success, or QF_DOESNT_EXIST if nothing is left. */
+static int hm_evict(HM *hm, uint64_t quotient) {
+  uint64_t run = find_next_run(hm, quotient);
+  if (run >= hm->metadata->nslots)  // The table is full elsewhere.
+    run = find_next_run(hm, 0);
+  qfposition pos, first;
+  uint64_t nscanned = 0;
+  for (; run < hm->metadata->nslots; run = find_next_run(hm, run + 1)) {
+    pos.quotient = run;
+    pos.run_start = std::max(run_start(hm, run), (size_t)run);
+    pos.run_end = runends_select(hm, pos.run_start, 0) + 1;
+    for (pos.index = pos.run_start; pos.index < pos.run_end; pos.index++) {
+#ifdef QF_TOMBSTONE
+      if (is_tombstone(hm, pos.index))
+        continue;
+#endif
+#ifdef QF_TTL
+      if (is_slot_expired(hm, pos.index))
+        return hm_remove_at(hm, &pos);
+#endif
+      if (!is_slot_referenced(hm, pos.index))
+        return hm_remove_at(hm, &pos);
+      set_slot_referenced(hm, pos.index, false);
+      if (nscanned++ == 0)
+        first = pos;
+      if (nscanned == QF_CACHE_SCAN)
+        return hm_remove_at(hm, &first);
+    }
+  }
+  if (nscanned == 0)
+    return QF_DOESNT_EXIST;
+  return hm_remove_at(hm, &first);
+}
+
+int hm_cache_insert(HM *hm, uint64_t key, uint64_t value, uint8_t flags) {
+  qfposition pos;
+  if (hm_find_key(hm, key, flags, &pos))
+    return QF_KEY_EXISTS;
+  uint64_t hash_remainder;
+  quotien_remainder(hm, key2hash(hm, key, flags), &pos.quotient,
+                    &hash_remainder);
+
+  if (hm->metadata->nelts >= hm->metadata->cache_capacity)
+    hm_evict(hm, pos.quotient);
+  int ret = hm_insert(hm, key, value, flags);
+  // The victim may have left its slot before the insert position.
+  for (int i = 0; ret == QF_NO_SPACE && i < QF_CACHE_SCAN; i++) {
+    if (hm_evict(hm, pos.quotient) < 0)
+      break;
+    ret = hm_insert(hm, key, value, flags);
+  }
+  return ret;
+}
+
+int hm_cache_lookup(HM *hm, uint64_t key, uint64_t *value, uint8_t flags) {
+  qfposition pos;
+  if (!hm_find_key(hm, key, flags, &pos))
+    return QF_DOESNT_EXIST;
+  set_slot_referenced(hm, pos.index, true);
+  *value = get_slot_value(hm, pos.index);
+  return 0;
+}
+#endif
+
+int64_t hm_erase_if(HM *hm, hm_erase_pred pred, void *arg,
+                    bool redistribute) {
+  int64_t nerased = 0;
+  uint64_t first_run = hm->metadata->nslots;
+  bool changed;
+  qfposition pos;
+  // Runs are laid out in order, each starts past the end of the one before.
+  // The first starts past the last run if it wrapped around into block 0.
+  uint64_t prev_run_end = run_start(hm, 0);
+  for (uint64_t run = find_next_run(hm, 0); run < hm->metadata->nslots;
+       run = find_next_run(hm, run + 1)) {
+    pos.quotient = run;
+    pos.run_start = std::max(prev_run_end, run);
+    pos.run_end = runends_select(hm, pos.run_start, 0) + 1;
+    changed = false;
+    // Backwards, so a removal only moves slots already visited.
+    for (pos.index = pos.run_end; pos.index-- > pos.run_start;) {
+#ifdef QF_TOMBSTONE
+      if (is_tombstone(hm, pos.index))
+        continue;
+#endif
+#ifdef QF_TTL
+      // Expired items are gone already, only their slots are left to free.
+      if (is_slot_expired(hm, pos.index)) {
+        hm_remove_at(hm, &pos);
+        changed = true;
+        continue;
+      }
+#endif
+      uint64_t key = (run << hm->metadata->key_remainder_bits) |
+                     get_slot_remainder(hm, pos.index);
+      if (hm->metadata->hash_mode == QF_HASH_INVERTIBLE)
+        key = hash_64i(key, BITMASK(hm->metadata->key_bits));
+      if (!pred(key, get_slot_value(hm, pos.index), arg))
+        continue;
+      int ret = hm_remove_at(hm, &pos);
+      if (ret < 0)
+        return ret;
+      first_run = std::min(first_run, run);
+      changed = true;
+      nerased++;
+    }
+    // The run may have shrunk or gone, its old slots are free or tombstones.
+    if (!changed)
+      prev_run_end = pos.run_end;
+    else if (is_occupied(hm, run))
+      prev_run_end = runends_select(hm, pos.run_start, 0) + 1;
+    else
+      prev_run_end = pos.run_start;
+  }
+#ifdef REBUILD_DEAMORTIZED_GRAVEYARD
+  // The next windows start on the tombstones just made.
+  if (redistribute && nerased)
+    hm->metadata->rebuild_run = first_run;
+#endif
+  return nerased;
+}
+
+/* Prefetch blocks [from, until) for reading. */
+static inline void hm_prefetch_blocks(const HM *hm, uint64_t from,
+                                      uint64_t until) {
+#if QF_BITS_PER_SLOT > 0
+  const uint64_t block_bytes = sizeof(qfblock);
+#else
+  const uint64_t block_bytes =
+      sizeof(qfblock) + QF_SLOTS_PER_BLOCK * hm->metadata->bits_per_slot / 8;
+#endif
+  for (uint64_t b = from; b < until; b++) {
+    const char *block = (const char *)get_block(hm, b);
+    for (uint64_t offset = 0; offset < block_bytes; offset += 64)
+      __builtin_prefetch(block + offset);
+  }
+}
+
+int64_t hm_scan_range(const HM *hm, uint64_t lo, uint64_t hi,
+                      hm_scan_callback callback, void *arg) {
+  const uint64_t key_bits = hm->metadata->key_bits;
+  const uint64_t remainder_bits = hm->metadata->key_remainder_bits;
+  if (key_bits < 64 && hi > (1ULL << key_bits))
+    hi = 1ULL << key_bits;
+  if (lo >= hi)
+    return 0;
+  // Seek to the start of the run of `lo` and filter from there: UNORDERED
+  // runs are only ordered by quotient.
+  const uint64_t last_quotient = (hi - 1) >> remainder_bits;
+  const uint64_t last_block =
+      std::min<uint64_t>(last_quotient / QF_SLOTS_PER_BLOCK + 2,
+                         hm->metadata->nblocks);
+  QFi qfi;
+  if (qf_iterator_from_key(hm, &qfi, lo >> remainder_bits << remainder_bits,
+                           QF_NO_LOCK | QF_KEY_IS_HASH) < 0)
+    return 0;
+
+  uint64_t keys[QF_JOIN_BATCH], values[QF_JOIN_BATCH];
+  uint64_t prefetched = qfi.current / QF_SLOTS_PER_BLOCK;
+  int64_t npassed = 0;
+  size_t n;
+  bool done = false;
+  while (!done &&
+         (n = qfi_next_batch(&qfi, keys, values, QF_JOIN_BATCH)) > 0) {
+    // The next batch spans at least QF_JOIN_BATCH slots from here.
+    const uint64_t until = std::min<uint64_t>(
+        (qfi.current + QF_JOIN_BATCH) / QF_SLOTS_PER_BLOCK + 1, last_block);
+    hm_prefetch_blocks(hm,
+                       std::max<uint64_t>(prefetched,
+                                          qfi.current / QF_SLOTS_PER_BLOCK),
+                       until);
+    prefetched = std::max(prefetched, until);
+
+    size_t m = 0;
+    for (size_t i = 0; i < n; i++) {
+      const uint64_t hash = keys[i];
+      if ((hash >> remainder_bits) > last_quotient) {
+        done = true;
+        break;
+      }
+      if (hash < lo || hash >= hi)
+        continue;
+      keys[m] = hm->metadata->hash_mode == QF_HASH_INVERTIBLE
+                    ? hash_64i(hash, BITMASK(key_bits))
+                    : hash;
+      values[m++] = values[i];
+    }
+    if (m > 0)
+      callback(keys, values, m, arg);
+    npassed += m;
+  }
+  return npassed;
+}
+
+/* Split the slots of `hm` in `nthreads` ranges of about as many blocks,
+ * each moved forward to an empty slot. No cluster crosses an empty slot, so
+ * range t holds the runs of the quotients [bounds[t], bounds[t + 1]) whole,
+ * and an iterator starts on it without looking back for a run start. */
+static std::vector<uint64_t> hm_cluster_bounds(const HM *hm,
+                                               uint32_t nthreads) {
+  const uint64_t nslots = hm->metadata->nslots;
+  const uint64_t nblocks = hm->metadata->nblocks;
+  std::vector<uint64_t> bounds(nthreads + 1, nslots);
+  bounds[0] = 0;
+  for (uint32_t t = 1; t < nthreads; t++) {
+    uint64_t bound = std::max<uint64_t>(
+        bounds[t - 1], nblocks * t / nthreads * QF_SLOTS_PER_BLOCK);
+    if (bound >= nslots || find_first_empty_slot((QF *)hm, bound, &bound) < 0)
+      bound = nslots;
+    bounds[t] = std::min(bound, nslots);
+  }
+  return bounds;
+}
+
+/* Pass the items of quotients [from, until) to visit(keys, values, n) in
+ * batches decoded with qfi_next_batch, with keys as qfi_get_key returns
+ * them. Return the number of items visited. */
+template <typename Visit>
+static int64_t hm_visit_quotients(const HM *hm, uint64_t from, uint64_t until,
+                                  Visit visit) {
+  const uint64_t remainder_bits = hm->metadata->key_remainder_bits;
+  const bool invertible = hm->metadata->hash_mode == QF_HASH_INVERTIBLE;
+  QFi qfi;
+  if (from >= until || qf_iterator_from_position(hm, &qfi, from) < 0)
+    return 0;
+  uint64_t keys[QF_JOIN_BATCH], values[QF_JOIN_BATCH];
+  int64_t nvisited = 0;
+  while (!qfi_end(&qfi) && qfi.run < until) {
+    size_t n = qfi_next_batch(&qfi, keys, values, QF_JOIN_BATCH);
+    // Runs are in quotient order, so only the last batch reaches past the
+    // range.
+    for (size_t i = 0; i < n; i++) {
+      if ((keys[i] >> remainder_bits) >= until) {
+        n = i;
+        break;
+      }
+      if (invertible)
+        keys[i] = hash_64i(keys[i], BITMASK(hm->metadata->key_bits));
+    }
+    if (n > 0)
+      visit(keys, values, n);
+    nvisited += n;
+  }
+  return nvisited;
+}
+
+int64_t hm_parallel_for_each(const HM *hm, uint32_t nthreads,
+                             hm_for_each_callback callback, void *arg) {
+  if (nthreads == 0)
+    nthreads = 1;
+  const std::vector<uint64_t> bounds = hm_cluster_bounds(hm, nthreads);
+  std::vector<int64_t> counts(nthreads);
+  auto visit = [&](uint32_t t) {
+    counts[t] = hm_visit_quotients(
+        hm, bounds[t], bounds[t + 1],
+        [&](const uint64_t *keys, const uint64_t *values, size_t n) {
+          callback(keys, values, n, t, arg);
+        });
+  };
+  std::vector<std::thread> threads;
+  for (uint32_t t = 1; t < nthreads; t++)
+    threads.emplace_back(visit, t);
+  visit(0);
+  for (auto &thread : threads)
+    thread.join();
+
+  int64_t count = 0;
+  for (uint32_t t = 0; t < nthreads; t++)
+    count += counts[t];
+  return count;
+}
+
+int64_t hm_parallel_reduce(const HM *hm, uint32_t nthreads, void *result,
+                           size_t result_size, hm_reduce_fn reduce,
+                           hm_combine_fn combine, void *arg) {
+  if (nthreads == 0)
+    nthreads = 1;
+  // One partial result per thread, each on its own cache lines.
+  const size_t stride = (result_size + 63) / 64 * 64;
+  std::vector<uint64_t> partials(nthreads * stride / sizeof(uint64_t) + 8);
+  char *base = (char *)(((uintptr_t)partials.data() + 63) & ~(uintptr_t)63);
+  for (uint32_t t = 0; t < nthreads; t++)
+    memcpy(base + t * stride, result, result_size);
+
+  struct reduce_arg {
+    char *base;
+    size_t stride;
+    hm_reduce_fn reduce;
+    void *arg;
+  } ra = {base, stride, reduce, arg};
+  const int64_t count = hm_parallel_for_each(
+      hm, nthreads,
+      [](const uint64_t *keys, const uint64_t *values, size_t n,
+         uint32_t thread, void *arg) {
+        reduce_arg *ra = (reduce_arg *)arg;
+        ra->reduce(ra->base + thread * ra->stride, keys, values, n, ra->arg);
+      },
+      &ra);
+  for (uint32_t t = 0; t < nthreads; t++)
+    combine(result, base + t * stride, arg);
+  return count;
 }
 
 int hm_lookup(const QF *hm, uint64_t key, uint64_t *value, uint8_t flags) {
@@ -107,6 +500,519 @@ int hm_lookup(const QF *hm, uint64_t key, uint64_t *value, uint8_t flags) {
 #endif
 }
 
+int hm_upsert(HM *hm, uint64_t key, uint64_t value, uint8_t flags) {
+  qfposition pos;
+  if (hm_find_key(hm, key, flags, &pos)) {
+    set_slot_value(hm, pos.index, value);
+    return 1;
+  }
+  int ret = hm_insert(hm, key, value, flags);
+  return ret < 0 ? ret : 0;
+}
+
+int hm_fetch_add(HM *hm, uint64_t key, uint64_t delta, uint64_t *old_value,
+                 uint8_t flags) {
+  qfposition pos;
+  if (hm_find_key(hm, key, flags, &pos)) {
+    *old_value = get_slot_value(hm, pos.index);
+    set_slot_value(hm, pos.index, *old_value + delta);
+    return 1;
+  }
+  *old_value = 0;
+  int ret = hm_insert(hm, key, delta, flags);
+  return ret < 0 ? ret : 0;
+}
+
+int hm_compare_exchange(HM *hm, uint64_t key, uint64_t *expected,
+                        uint64_t desired, uint8_t flags) {
+  qfposition pos;
+  if (!hm_find_key(hm, key, flags, &pos))
+    return QF_DOESNT_EXIST;
+  const uint64_t current = get_slot_value(hm, pos.index);
+  if (current != (*expected & value_mask(hm))) {
+    *expected = current;
+    return QF_VALUE_MISMATCH;
+  }
+  set_slot_value(hm, pos.index, desired);
+  return 0;
+}
+
+int hm_count_insert(HM *hm, uint64_t key, uint64_t count, uint8_t flags) {
+  const uint64_t max_count = value_mask(hm);
+  if (max_count == 0)
+    return QF_INVALID;
+  qfposition pos;
+  if (hm_find_key(hm, key, flags, &pos)) {
+    const uint64_t old_count = get_slot_value(hm, pos.index);
+    set_slot_value(hm, pos.index,
+                   count > max_count - old_count ? max_count
+                                                 : old_count + count);
+    return 1;
+  }
+  int ret = hm_insert(hm, key, std::min(count, max_count), flags);
+  return ret < 0 ? ret : 0;
+}
+
+int hm_count_remove(HM *hm, uint64_t key, uint64_t count, uint8_t flags) {
+  if (value_mask(hm) == 0)
+    return QF_INVALID;
+  qfposition pos;
+  if (!hm_find_key(hm, key, flags, &pos))
+    return QF_DOESNT_EXIST;
+  const uint64_t old_count = get_slot_value(hm, pos.index);
+  if (count < old_count) {
+    set_slot_value(hm, pos.index, old_count - count);
+    return 1;
+  }
+  int ret = hm_remove_at(hm, &pos);
+  return ret < 0 ? ret : 0;
+}
+
+uint64_t hm_count(const HM *hm, uint64_t key, uint8_t flags) {
+  uint64_t count;
+  if (hm_lookup(hm, key, &count, flags) < 0)
+    return 0;
+  return count;
+}
+
+/* Allocate `hm` with `nslots` slots and `key_bits` key bits, and otherwise
+ * the parameters of `like`, for the partitions of hm_split and hm_merge. */
+static bool hm_malloc_like(HM *hm, const HM *like, uint64_t nslots,
+                           uint64_t key_bits) {
+  uint64_t tombstone_space = 0, rebuild_interval = 0, nrebuilds = 0;
+#ifdef QF_TOMBSTONE
+  tombstone_space = like->metadata->tombstone_space;
+  rebuild_interval = like->metadata->rebuild_interval;
+  nrebuilds = like->metadata->nrebuilds;
+#endif
+  if (!qf_malloc_advance(hm, nslots, key_bits, slot_data_bits(like),
+                         like->metadata->hash_mode, like->metadata->seed,
+                         tombstone_space, rebuild_interval, nrebuilds))
+    return false;
+#ifdef QF_TOMBSTONE
+  reset_rebuild_cd(hm);
+#endif
+#ifdef QF_TTL
+  hm->metadata->clock = like->metadata->clock;
+#endif
+#ifdef QF_CACHE
+  hm->metadata->cache_capacity =
+      like->metadata->cache_capacity * nslots / like->metadata->nslots;
+#endif
+  return true;
+}
+
+/* A run of an earlier quotient reaches into `index`. */
+static inline bool hm_run_crosses(const HM *hm, uint64_t index) {
+  return offset_lower_bound(hm, index) - is_occupied(hm, index) > 0;
+}
+
+/* Copy the quotients [from, until) of `src`, whole blocks, to `dst` from
+ * quotient `to` on. The clusters that cross `from` or `until` are left out:
+ * their items with quotients in [from, *lead_end) and [*tail_start, until)
+ * are for the caller to reinsert. Every other run stays where it is, so only
+ * the offsets of the blocks around the cut clusters change. */
+static void hm_copy_quotients(HM *dst, uint64_t to, const HM *src,
+                              uint64_t from, uint64_t until,
+                              uint64_t *lead_end, uint64_t *tail_start) {
+#if QF_BITS_PER_SLOT > 0
+  const uint64_t block_bytes = sizeof(qfblock);
+#else
+  const uint64_t block_bytes =
+      sizeof(qfblock) + QF_SLOTS_PER_BLOCK * src->metadata->bits_per_slot / 8;
+#endif
+  memcpy(get_block(dst, to / QF_SLOTS_PER_BLOCK),
+         get_block(src, from / QF_SLOTS_PER_BLOCK),
+         (until - from) / QF_SLOTS_PER_BLOCK * block_bytes);
+
+  *lead_end = from;
+  if (hm_run_crosses(src, from) &&
+      find_first_empty_slot((QF *)src, from, lead_end) < 0)
+    *lead_end = until;
+  *lead_end = std::min(*lead_end, until);
+  *tail_start = until;
+  if (until < src->metadata->xnslots && hm_run_crosses(src, until)) {
+    while (*tail_start > *lead_end && !is_empty(src, *tail_start - 1))
+      (*tail_start)--;
+  }
+
+  // Slots and quotients of the cut clusters, relative to `to`.
+  auto cut = [&](uint64_t begin, uint64_t end) {
+    for (uint64_t i = to + begin; i < to + end; i++) {
+      METADATA_WORD(dst, occupieds, i) &= ~(1ULL << (i % 64));
+      METADATA_WORD(dst, runends, i) &= ~(1ULL << (i % 64));
+#ifdef QF_TOMBSTONE
+      METADATA_WORD(dst, tombstones, i) |= 1ULL << (i % 64);
+#endif
+    }
+  };
+  cut(0, *lead_end - from);
+  cut(*tail_start - from, until - from);
+
+  get_block(dst, to / QF_SLOTS_PER_BLOCK)->offset = 0;
+#ifdef _BLOCKOFFSET_4_NUM_RUNENDS
+  _recalculate_block_offsets(dst, to, to + *lead_end - from);
+  _recalculate_block_offsets(dst, to + *tail_start - from, to + until - from);
+#else
+  _recalculate_block_offsets(dst, to);
+  _recalculate_block_offsets(dst, to + *tail_start - from);
+#endif
+
+  // No run crosses the ends of what is left, so its items can be counted.
+  int64_t depth = 0;
+  for (uint64_t i = to + *lead_end - from; i < to + *tail_start - from; i++) {
+    depth += is_occupied(dst, i);
+    if (depth > 0) {
+      dst->metadata->noccupied_slots++;
+#ifdef QF_TOMBSTONE
+      dst->metadata->nelts += !is_tombstone(dst, i);
+#else
+      dst->metadata->nelts++;
+#endif
+    }
+    depth -= is_runend(dst, i);
+  }
+}
+
+/* Insert the items of quotients [from, until) of `src` into `dst`, with
+ * their hashes cut to the key bits of `dst` and `prefix` put above them.
+ * The value bits are copied as they are, expiry and reference bit included. */
+static int hm_reinsert_quotients(HM *dst, const HM *src, uint64_t from,
+                                 uint64_t until, uint64_t prefix) {
+  const uint64_t remainder_bits = src->metadata->key_remainder_bits;
+  const uint64_t value_bits = src->metadata->value_bits;
+  if (from >= until)
+    return 0;
+  QFi qfi;
+  if (qf_iterator_from_key(src, &qfi, from << remainder_bits,
+                           QF_NO_LOCK | QF_KEY_IS_HASH) < 0)
+    return 0;
+  for (; !qfi_end(&qfi) && qfi.run < until; qfi_next(&qfi)) {
+    const uint64_t slot = get_slot(src, qfi.current);
+    const uint64_t hash = (qfi.run << remainder_bits) | (slot >> value_bits);
+    int ret = _hm_insert(dst,
+                         prefix | (hash & BITMASK(dst->metadata->key_bits)),
+                         slot & BITMASK(value_bits),
+                         QF_NO_LOCK | QF_KEY_IS_HASH);
+    if (ret < 0)
+      return ret;
+  }
+  return 0;
+}
+
+/* Whether `hm` can be split into partitions and merged back. Runs wrap
+ * around a QF_CIRCULAR table, QF_VALUE_POOL slots point into a per-table
+ * pool, and QF_HASH_INVERTIBLE hashes of a partition aren't the low bits of
+ * the map's. */
+static inline bool hm_partitionable(const HM *hm) {
+#if defined(QF_CIRCULAR) || defined(QF_VALUE_POOL)
+  return false;
+#else
+  return hm->metadata->hash_mode != QF_HASH_INVERTIBLE;
+#endif
+}
+
+int hm_split(const HM *src, uint32_t k, HM *dst) {
+  const uint64_t nparts = 1ULL << k;
+  const uint64_t part_slots = src->metadata->nslots >> k;
+  if (!hm_partitionable(src) || part_slots < QF_SLOTS_PER_BLOCK ||
+      part_slots % QF_SLOTS_PER_BLOCK != 0)
+    return QF_INVALID;
+
+  for (uint64_t p = 0; p < nparts; p++) {
+    if (!hm_malloc_like(&dst[p], src, part_slots,
+                        src->metadata->key_bits - k)) {
+      while (p-- > 0)
+        hm_free(&dst[p]);
+      return QF_NO_SPACE;
+    }
+    uint64_t lead_end, tail_start;
+    const uint64_t from = p * part_slots, until = from + part_slots;
+    hm_copy_quotients(&dst[p], 0, src, from, until, &lead_end, &tail_start);
+    int ret = hm_reinsert_quotients(&dst[p], src, from, lead_end, 0);
+    if (ret == 0)
+      ret = hm_reinsert_quotients(&dst[p], src, tail_start, until, 0);
+#ifdef QF_BLOCK_SUMMARY
+    summary_sync_blocks(&dst[p], 0, dst[p].metadata->nblocks - 1);
+#endif
+    if (ret < 0) {
+      while (true) {
+        hm_free(&dst[p]);
+        if (p-- == 0)
+          break;
+      }
+      return ret;
+    }
+  }
+  return 0;
+}
+
+int hm_merge(const HM *src, uint32_t k, HM *dst) {
+  const uint64_t nparts = 1ULL << k;
+  const uint64_t part_slots = src[0].metadata->nslots;
+  const uint64_t part_key_bits = src[0].metadata->key_bits;
+  if (!hm_partitionable(&src[0]) || part_slots % QF_SLOTS_PER_BLOCK != 0)
+    return QF_INVALID;
+  for (uint64_t p = 1; p < nparts; p++) {
+    if (src[p].metadata->nslots != part_slots ||
+        src[p].metadata->key_bits != part_key_bits ||
+        src[p].metadata->value_bits != src[0].metadata->value_bits ||
+        src[p].metadata->hash_mode != src[0].metadata->hash_mode ||
+        src[p].metadata->seed != src[0].metadata->seed)
+      return QF_INVALID;
+  }
+  if (!hm_malloc_like(dst, &src[0], part_slots << k, part_key_bits + k))
+    return QF_NO_SPACE;
+
+  // The tails of the partitions may spill into the next one, so they are
+  // only reinserted once every partition is in place.
+  std::vector<uint64_t> tail_starts(nparts);
+  for (uint64_t p = 0; p < nparts; p++) {
+    uint64_t lead_end;
+    hm_copy_quotients(dst, p * part_slots, &src[p], 0, part_slots, &lead_end,
+                      &tail_starts[p]);
+  }
+  for (uint64_t p = 0; p < nparts; p++) {
+    int ret = hm_reinsert_quotients(dst, &src[p], tail_starts[p], part_slots,
+                                    p << part_key_bits);
+    if (ret < 0) {
+      hm_free(dst);
+      return ret;
+    }
+  }
+#ifdef QF_BLOCK_SUMMARY
+  summary_sync_blocks(dst, 0, dst->metadata->nblocks - 1);
+#endif
+  return 0;
+}
+
+static inline uint64_t hm_combine(enum hm_agg_op op, uint64_t aggregate,
+                                  uint64_t value) {
+  switch (op) {
+  case HM_AGG_MIN:
+    return std::min(aggregate, value);
+  case HM_AGG_MAX:
+    return std::max(aggregate, value);
+  default:
+    return aggregate + value;
+  }
+}
+
+int hm_aggregate(HM *hm, uint64_t key, uint64_t value, enum hm_agg_op op,
+                 uint8_t flags) {
+  value = op == HM_AGG_COUNT ? 1 : value & value_mask(hm);
+  qfposition pos;
+  if (hm_find_key(hm, key, flags, &pos)) {
+    set_slot_value(hm, pos.index,
+                   hm_combine(op, get_slot_value(hm, pos.index), value));
+    return 1;
+  }
+  int ret = hm_insert(hm, key, value, flags);
+  return ret < 0 ? ret : 0;
+}
+
+/* Fold the items of `src` whose quotients in `dst` are in [from, until) into
+ * the slots of their keys in `dst`, walking both maps in quotient order: the
+ * run of the next quotient in `dst` is found from the end of the last one,
+ * without looking up block offsets, unless it is far away. Only values in
+ * blocks of its own are written, so ranges cut at empty slots can be folded
+ * concurrently. Updates in the blocks of `from` and `until` go to
+ * `deferred` as (slot, value), items whose key is missing from `dst` to
+ * `missing` as (hash, value).
+ * Return the number of items of `src` in the range. */
+static int64_t
+hm_fold_quotients(HM *dst, const HM *src, enum hm_agg_op op, uint64_t from,
+                  uint64_t until,
+                  std::vector<std::pair<uint64_t, uint64_t>> *deferred,
+                  std::vector<std::pair<uint64_t, uint64_t>> *missing) {
+  const uint64_t remainder_bits = dst->metadata->key_remainder_bits;
+  const uint64_t src_remainder_bits = src->metadata->key_remainder_bits;
+  const uint64_t value_bits = dst->metadata->value_bits;
+  const uint64_t from_block = from > 0 ? from / QF_SLOTS_PER_BLOCK : UINT64_MAX;
+  const uint64_t until_block = until < dst->metadata->nslots
+                                   ? until / QF_SLOTS_PER_BLOCK
+                                   : UINT64_MAX;
+  // The last quotient of `src` that overlaps the range, whose run may be
+  // unordered across the end of the range.
+  const uint64_t src_last =
+      ((until << remainder_bits) - 1) >> src_remainder_bits;
+  QFi qfi;
+  if (from >= until ||
+      qf_iterator_from_position(src, &qfi,
+                                (from << remainder_bits) >>
+                                    src_remainder_bits) < 0)
+    return 0;
+  // The last run found in `dst`, from slot `start` to its runend `end`.
+  uint64_t run = UINT64_MAX, start = 0, end = 0;
+
+  uint64_t hashes[QF_JOIN_BATCH], values[QF_JOIN_BATCH];
+  int64_t nfolded = 0;
+  size_t n;
+  while ((n = qfi_next_batch(&qfi, hashes, values, QF_JOIN_BATCH)) > 0) {
+    for (size_t i = 0; i < n; i++) {
+      const uint64_t quotient = hashes[i] >> remainder_bits;
+      const uint64_t remainder = hashes[i] & BITMASK(remainder_bits);
+      if ((hashes[i] >> src_remainder_bits) > src_last)
+        return nfolded;
+      if (quotient < from || quotient >= until)
+        continue;
+      nfolded++;
+      const uint64_t value = values[i] & value_mask(dst);
+      if (!is_occupied(dst, quotient)) {
+        missing->emplace_back(hashes[i], value);
+        continue;
+      }
+      // A smaller UNORDERED `src` may go back to an earlier quotient.
+      if (run == UINT64_MAX || run > quotient ||
+          quotient - run > QF_SLOTS_PER_BLOCK) {
+        start = run_start(dst, quotient);
+        end = runends_select(dst, start, 0);
+      } else if (run < quotient) {
+        // The runs of the next occupied quotients follow in order.
+        const uint64_t k = occupieds_cnt(dst, run + 1, quotient - run);
+        start = std::max<uint64_t>(
+            quotient, k > 1 ? runends_select(dst, end + 1, k - 2) + 1 : end + 1);
+        end = runends_select(dst, start, 0);
+      }
+      run = quotient;
+      bool found = false;
+      for (uint64_t index = start; index <= end; index++) {
+#ifdef QF_TOMBSTONE
+        if (is_tombstone(dst, index))
+          continue;
+#endif
+#ifdef QF_TTL
+        if (is_slot_expired(dst, index))
+          continue;
+#endif
+        const uint64_t slot_remainder = get_slot(dst, index) >> value_bits;
+#ifndef UNORDERED
+        if (slot_remainder > remainder)
+          break;
+#endif
+        if (slot_remainder != remainder)
+          continue;
+        const uint64_t block = index / QF_SLOTS_PER_BLOCK;
+        if (block == from_block || block == until_block)
+          deferred->emplace_back(index, value);
+        else
+          set_slot_value(dst, index,
+                         hm_combine(op, get_slot_value(dst, index), value));
+        found = true;
+        break;
+      }
+      if (!found)
+        missing->emplace_back(hashes[i], value);
+    }
+  }
+  return nfolded;
+}
+
+int64_t hm_aggregate_merge(HM *dst, const HM *src, enum hm_agg_op op,
+                           uint32_t nthreads, uint8_t flags) {
+  if (dst->metadata->hash_mode != src->metadata->hash_mode ||
+      dst->metadata->seed != src->metadata->seed ||
+      dst->metadata->key_bits != src->metadata->key_bits)
+    return QF_INVALID;
+#ifdef QF_CIRCULAR
+  // The last runs wrap around into the first range.
+  nthreads = 1;
+#endif
+  if (nthreads == 0)
+    nthreads = 1;
+  // Partial counts add up.
+  if (op == HM_AGG_COUNT)
+    op = HM_AGG_SUM;
+
+  // Each thread folds one cluster-aligned range of `dst` in place. Once all
+  // are done, the updates in blocks shared by two ranges are applied, then
+  // the missing keys inserted, range after range: they shift slots across
+  // the range ends.
+  const std::vector<uint64_t> bounds = hm_cluster_bounds(dst, nthreads);
+  std::vector<std::vector<std::pair<uint64_t, uint64_t>>> deferred(nthreads),
+      missing(nthreads);
+  std::vector<int64_t> counts(nthreads);
+  auto fold = [&](uint32_t t) {
+    counts[t] = hm_fold_quotients(dst, src, op, bounds[t], bounds[t + 1],
+                                  &deferred[t], &missing[t]);
+  };
+  std::vector<std::thread> threads;
+  for (uint32_t t = 1; t < nthreads; t++)
+    threads.emplace_back(fold, t);
+  fold(0);
+  for (auto &thread : threads)
+    thread.join();
+
+  int64_t nfolded = 0;
+  for (uint32_t t = 0; t < nthreads; t++) {
+    for (const auto &update : deferred[t])
+      set_slot_value(dst, update.first,
+                     hm_combine(op, get_slot_value(dst, update.first),
+                                update.second));
+    nfolded += counts[t];
+  }
+  for (uint32_t t = 0; t < nthreads; t++) {
+    for (const auto &item : missing[t]) {
+      int ret = hm_insert(dst, item.first, item.second, flags | QF_KEY_IS_HASH);
+      if (ret < 0)
+        return ret;
+    }
+  }
+  return nfolded;
+}
+
+int hm_filter_insert(HM *hm, uint64_t key, uint8_t flags) {
+  return hm_count_insert(hm, key, 1, flags);
+}
+
+int hm_filter_remove(HM *hm, uint64_t key, uint8_t flags) {
+  return hm_count_remove(hm, key, 1, flags);
+}
+
+bool hm_filter_query(const HM *hm, uint64_t key, uint8_t flags) {
+  uint64_t count;
+  return hm_lookup(hm, key, &count, flags) >= 0;
+}
+
+int hm_find_handle(const HM *hm, uint64_t key, uint64_t *value,
+                   hm_handle *handle, uint8_t flags) {
+  handle->key = key;
+  handle->flags = flags;
+  if (!hm_find_key(hm, key, flags, &handle->pos)) {
+    // Stale from the start, a later use probes again.
+    handle->epoch = hm->metadata->epoch - 1;
+    return QF_DOESNT_EXIST;
+  }
+  handle->epoch = hm->metadata->epoch;
+  if (value)
+    *value = get_slot_value(hm, handle->pos.index);
+  return 0;
+}
+
+/* Re-probe for the key of a handle whose position may have moved. */
+static inline int hm_refresh_handle(const HM *hm, hm_handle *handle) {
+  if (handle->epoch == hm->metadata->epoch)
+    return 1;
+  if (!hm_find_key(hm, handle->key, handle->flags, &handle->pos))
+    return 0;
+  handle->epoch = hm->metadata->epoch;
+  return 1;
+}
+
+int hm_update_handle(HM *hm, hm_handle *handle, uint64_t value) {
+  if (!hm_refresh_handle(hm, handle))
+    return QF_DOESNT_EXIST;
+  set_slot_value(hm, handle->pos.index, value);
+  return 0;
+}
+
+int hm_erase_handle(HM *hm, hm_handle *handle) {
+  if (!hm_refresh_handle(hm, handle))
+    return QF_DOESNT_EXIST;
+  // Bumps the epoch, so a later use of the handle probes and fails.
+  return hm_remove_at(hm, &handle->pos);
+}
+
 void hm_dump_metrics(const QF *qf, const std::string &dir) {
   // For each slot count the distance to nearest tombstone/free slot ahead of it.
   // For each slot count the distance to its home slot.
@@ -0,0 +1,236 @@
+#include "hm_str.h"
+#include "gqf.h"
+#include "gqf_int.h"
+#include "hashutil.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#define HM_STR_UNIT (8)
+#define HM_STR_MIN_UNITS (1024)
+
+/* Arena entry, followed by the key bytes and padded to a whole unit. */
+typedef struct hm_str_entry {
+	uint64_t value;
+	uint64_t next;  // Next entry with the same fingerprint, 0 ends the chain.
+	uint32_t len;
+	uint32_t dead;
+} hm_str_entry;
+
+static inline hm_str_entry *get_entry(const HMS *hms, uint64_t ref) {
+	return (hm_str_entry *)(hms->arena + ref * HM_STR_UNIT);
+}
+
+static inline const char *entry_key(const hm_str_entry *e) {
+	return (const char *)(e + 1);
+}
+
+static inline uint64_t entry_units(size_t len) {
+	return (sizeof(hm_str_entry) + len + HM_STR_UNIT - 1) / HM_STR_UNIT;
+}
+
+static inline uint64_t str_fingerprint(const HMS *hms, const void *key,
+																			 size_t len) {
+	return MurmurHash64A(key, len, hms->hm.metadata->seed) &
+		BITMASK(hms->hm.metadata->key_bits);
+}
+
+/* Walk the chain from `ref` for `key`. Return its ref, or 0. Set `prev` to
+ * the entry before it, 0 if it is the head. */
+static uint64_t chain_find(const HMS *hms, uint64_t ref, const void *key,
+													 size_t len, uint64_t *prev) {
+	*prev = 0;
+	while (ref) {
+		const hm_str_entry *e = get_entry(hms, ref);
+		if (e->len == len && memcmp(entry_key(e), key, len) == 0)
+			return ref;
+		*prev = ref;
+		ref = e->next;
+	}
+	return 0;
+}
+
+/* Allocate an entry for `key`. Return its ref, or 0 if the arena is full. */
+static uint64_t arena_alloc(HMS *hms, const void *key, size_t len,
+														uint64_t value, uint64_t next) {
+	const uint64_t units = entry_units(len);
+	if (hms->used_units + units > hms->max_units)
+		return 0;
+	if (hms->used_units + units > hms->arena_units) {
+		uint64_t new_units = hms->arena_units * 2;
+		while (new_units < hms->used_units + units)
+			new_units *= 2;
+		if (new_units > hms->max_units)
+			new_units = hms->max_units;
+		char *arena = (char *)realloc(hms->arena, new_units * HM_STR_UNIT);
+		if (arena == NULL)
+			return 0;
+		hms->arena = arena;
+		hms->arena_units = new_units;
+	}
+	const uint64_t ref = hms->used_units;
+	hm_str_entry *e = get_entry(hms, ref);
+	e->value = value;
+	e->next = next;
+	e->len = len;
+	e->dead = 0;
+	memcpy((char *)(e + 1), key, len);
+	hms->used_units += units;
+	return ref;
+}
+
+static inline void arena_release(HMS *hms, uint64_t ref) {
+	hm_str_entry *e = get_entry(hms, ref);
+	e->dead = 1;
+	hms->dead_units += entry_units(e->len);
+}
+
+bool hm_str_malloc(HMS *hms, uint64_t nslots, uint64_t fingerprint_bits,
+									 uint64_t ref_bits, uint32_t seed, float max_load_factor) {
+	if (!hm_malloc(&hms->hm, nslots, fingerprint_bits, ref_bits, QF_HASH_NONE,
+								 seed, max_load_factor))
+		return false;
+	hms->max_units = ref_bits >= 61 ? (1ULL << 61) : (1ULL << ref_bits);
+	hms->arena_units = std::min<uint64_t>(HM_STR_MIN_UNITS, hms->max_units);
+	hms->arena = (char *)malloc(hms->arena_units * HM_STR_UNIT);
+	if (hms->arena == NULL) {
+		hm_free(&hms->hm);
+		return false;
+	}
+	hms->used_units = 1;
+	hms->dead_units = 0;
+	return true;
+}
+
+bool hm_str_free(HMS *hms) {
+	free(hms->arena);
+	hms->arena = NULL;
+	return hm_free(&hms->hm);
+}
+
+int hm_str_insert(HMS *hms, const void *key, size_t len, uint64_t value,
+									uint8_t flags) {
+	const uint64_t fingerprint = str_fingerprint(hms, key, len);
+	flags |= QF_KEY_IS_HASH;
+
+	hm_handle handle;
+	uint64_t head, prev;
+	if (hm_find_handle(&hms->hm, fingerprint, &head, &handle, flags) == 0) {
+		if (chain_find(hms, head, key, len, &prev))
+			return QF_KEY_EXISTS;
+		// Fingerprint collision, put the key in front of the chain.
+		uint64_t ref = arena_alloc(hms, key, len, value, head);
+		if (ref == 0)
+			return QF_NO_SPACE;
+		return hm_update_handle(&hms->hm, &handle, ref);
+	}
+
+	uint64_t ref = arena_alloc(hms, key, len, value, 0);
+	if (ref == 0)
+		return QF_NO_SPACE;
+	int ret = hm_insert(&hms->hm, fingerprint, ref, flags);
+	if (ret < 0)
+		hms->used_units = ref;  // Nothing was allocated after it.
+	return ret;
+}
+
+int hm_str_lookup(const HMS *hms, const void *key, size_t len,
+									uint64_t *value, uint8_t flags) {
+	uint64_t head, prev;
+	if (hm_lookup(&hms->hm, str_fingerprint(hms, key, len), &head,
+								flags | QF_KEY_IS_HASH) < 0)
+		return QF_DOESNT_EXIST;
+	uint64_t ref = chain_find(hms, head, key, len, &prev);
+	if (ref == 0)
+		return QF_DOESNT_EXIST;
+	*value = get_entry(hms, ref)->value;
+	return 0;
+}
+
+int hm_str_remove(HMS *hms, const void *key, size_t len, uint8_t flags) {
+	const uint64_t fingerprint = str_fingerprint(hms, key, len);
+	flags |= QF_KEY_IS_HASH;
+
+	hm_handle handle;
+	uint64_t head, prev;
+	if (hm_find_handle(&hms->hm, fingerprint, &head, &handle, flags) < 0)
+		return QF_DOESNT_EXIST;
+	uint64_t ref = chain_find(hms, head, key, len, &prev);
+	if (ref == 0)
+		return QF_DOESNT_EXIST;
+
+	int ret = 0;
+	const uint64_t next = get_entry(hms, ref)->next;
+	if (prev)
+		get_entry(hms, prev)->next = next;
+	else if (next)
+		ret = hm_update_handle(&hms->hm, &handle, next);
+	else
+		ret = hm_erase_handle(&hms->hm, &handle);
+	if (ret < 0)
+		return ret;
+	arena_release(hms, ref);
+
+	if (hms->dead_units > HM_STR_MIN_UNITS &&
+			hms->dead_units > hms->used_units - hms->dead_units)
+		hm_str_compact(hms, flags);
+	return ret;
+}
+
+int hm_str_compact(HMS *hms, uint8_t flags) {
+	flags |= QF_KEY_IS_HASH;
+	const uint64_t live_units = hms->used_units - hms->dead_units;
+	uint64_t new_arena_units = HM_STR_MIN_UNITS;
+	while (new_arena_units < live_units)
+		new_arena_units *= 2;
+	new_arena_units = std::min(new_arena_units, hms->max_units);
+	char *new_arena = (char *)malloc(new_arena_units * HM_STR_UNIT);
+	if (new_arena == NULL)
+		return QF_NO_SPACE;
+
+	// Entries keep their order, so old refs stay sorted for the remap.
+	std::vector<uint64_t> old_refs, new_refs;
+	uint64_t new_used = 1;
+	for (uint64_t ref = 1; ref < hms->used_units;) {
+		const hm_str_entry *e = get_entry(hms, ref);
+		const uint64_t units = entry_units(e->len);
+		if (!e->dead) {
+			old_refs.push_back(ref);
+			new_refs.push_back(new_used);
+			memcpy(new_arena + new_used * HM_STR_UNIT, e, units * HM_STR_UNIT);
+			new_used += units;
+		}
+		ref += units;
+	}
+	auto remap = [&](uint64_t ref) {
+		if (ref == 0)
+			return ref;
+		auto it = std::lower_bound(old_refs.begin(), old_refs.end(), ref);
+		return new_refs[it - old_refs.begin()];
+	};
+
+	for (uint64_t i = 0; i < old_refs.size(); i++) {
+		const hm_str_entry *e = get_entry(hms, old_refs[i]);
+		hm_str_entry *ne = (hm_str_entry *)(new_arena + new_refs[i] * HM_STR_UNIT);
+		ne->next = remap(e->next);
+
+		// Chain heads are referenced from the table. A new ref is never above
+		// its old ref, so heads already rewritten can't match a later entry.
+		hm_handle handle;
+		uint64_t head;
+		if (hm_find_handle(&hms->hm, str_fingerprint(hms, entry_key(e), e->len),
+											 &head, &handle, flags) == 0 &&
+				head == old_refs[i])
+			hm_update_handle(&hms->hm, &handle, new_refs[i]);
+	}
+
+	free(hms->arena);
+	hms->arena = new_arena;
+	hms->arena_units = new_arena_units;
+	hms->used_units = new_used;
+	hms->dead_units = 0;
+	return 0;
+}
@@ -11,6 +11,8 @@ using namespace std;
 #define INSERT 0
 #define DELETE 1
 #define LOOKUP 2
+#define NEG_LOOKUP 3  // Lookup of a key that was never inserted.
+#define CACHE_ACCESS 4  // Lookup, inserting the key if it is missing.
 
 struct hm_op {
   int op;
@@ -9,21 +9,60 @@
 HM g_hashmap;
 uint64_t value_mem_compensation = 0;
 
+#ifdef QF_FILTER
+// Filter mode: key_size is the fingerprint width and value_size the width of
+// the counter of keys sharing a fingerprint. Keys are hashed by the filter.
+
+extern inline int g_init(uint64_t nslots, uint64_t key_size, uint64_t value_size, float max_load_factor)
+{
+	return hm_malloc(&g_hashmap, nslots, key_size, value_size, QF_HASH_DEFAULT, 0, max_load_factor);
+}
+
+extern inline int g_insert(uint64_t key, uint64_t val)
+{
+	return hm_filter_insert(&g_hashmap, key, QF_NO_LOCK);
+}
+
+extern inline int g_lookup(uint64_t key, uint64_t *val)
+{
+	return hm_filter_query(&g_hashmap, key, QF_NO_LOCK) ? 0 : QF_DOESNT_EXIST;
+}
+
+extern inline int g_remove(uint64_t key)
+{
+	int ret = hm_filter_remove(&g_hashmap, key, QF_NO_LOCK);
+	if (ret == QF_DOESNT_EXIST) return QF_DOESNT_EXIST;
+	return 0;
+}
+
+#else
+
 extern inline int g_init(uint64_t nslots, uint64_t key_size, uint64_t value_size, float max_load_factor)
 {
  	// log_2(nslots) will be used as quotient bits of key_size.
+#ifndef QF_VALUE_POOL
+	// The pool is already counted in total_size_in_bytes.
 	value_mem_compensation = nslots * sizeof(uint64_t);
+#endif
 	return hm_malloc(&g_hashmap, nslots, key_size, value_size, QF_HASH_NONE, 0, max_load_factor);
 }
 
 extern inline int g_insert(uint64_t key, uint64_t val)
 {
+#ifdef QF_CACHE
+	return hm_cache_insert(&g_hashmap, key, val, QF_NO_LOCK | QF_KEY_IS_HASH);
+#else
 	return hm_insert(&g_hashmap, key, val, QF_NO_LOCK | QF_KEY_IS_HASH);
+#endif
 }
 
 extern inline int g_lookup(uint64_t key, uint64_t *val)
 {
+#ifdef QF_CACHE
+	int ret = hm_cache_lookup(&g_hashmap, key, val, QF_NO_LOCK | QF_KEY_IS_HASH);
+#else
 	int ret = hm_lookup(&g_hashmap, key, val, QF_NO_LOCK | QF_KEY_IS_HASH);
+#endif
 	if (ret == QF_DOESNT_EXIST) return QF_DOESNT_EXIST;
 	return 0;
 }
@@ -35,6 +74,8 @@ extern inline int g_remove(uint64_t key)
 	return 0;
 }
 
+#endif
+
 extern inline int g_destroy()
 {
 	return hm_free(&g_hashmap);
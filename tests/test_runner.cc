@@ -5,7 +5,10 @@
 #include <set>
 #include <unistd.h>
 #include <vector>
+#include <tuple>
+#include <algorithm>
 #include <cassert>
+#include <cstring>
 #include "hm_op.h"
 #include "hm_wrapper.h"
 
@@ -131,6 +134,1053 @@ void check_universe(uint64_t key_bits, std::map<uint64_t, uint64_t> expected, bo
   }
 }
 
+#ifdef QFHM_WRAPPER_H
+#include "hashutil.h"
+#include "hm_str.h"
+
+// Focused tests of the map operations. Each builds maps of its own with the
+// key, quotient and value bits of the run, so their slots have the width a
+// QF_BITS_PER_SLOT build expects.
+
+#define EXPECT(cond)                                                         \
+  do {                                                                       \
+    if (!(cond)) {                                                           \
+      fprintf(stderr, "%s:%d: Expected %s.\n", __FILE__, __LINE__, #cond);   \
+      abort();                                                               \
+    }                                                                        \
+  } while (0)
+
+uint64_t random_key(uint64_t nbits = key_bits) {
+  return (((uint64_t)rand() << 62) ^ ((uint64_t)rand() << 31) ^ rand()) &
+         BITMASK(nbits);
+}
+
+void new_map(HM *hm, uint64_t qbits = quotient_bits, uint32_t seed = 0) {
+  EXPECT(hm_malloc(hm, 1ULL << qbits, key_bits, value_bits, QF_HASH_NONE,
+                   seed, 0.95));
+}
+
+// Insert random keys of `nbits` into `hm` until it holds `nkeys`, as `model`
+// does.
+void fill_map(HM *hm, std::map<uint64_t, uint64_t> &model, uint64_t nkeys,
+              uint64_t nbits = key_bits) {
+  while (model.size() < nkeys) {
+    uint64_t key = random_key(nbits), value = rand() & BITMASK(value_bits);
+    if (model.count(key))
+      continue;
+    EXPECT(hm_insert(hm, key, value, QF_NO_LOCK | QF_KEY_IS_HASH) >= 0);
+    model[key] = value;
+  }
+}
+
+// Fill `hm` to the load of the run and remove every third key, leaving
+// tombstones in the variants that have them.
+void churn_map(HM *hm, std::map<uint64_t, uint64_t> &model) {
+  fill_map(hm, model, (1ULL << quotient_bits) * initial_load_factor / 100);
+  uint64_t n = 0;
+  for (auto it = model.begin(); it != model.end(); n++) {
+    if (n % 3) {
+      it++;
+      continue;
+    }
+    EXPECT(hm_remove(hm, it->first, QF_NO_LOCK | QF_KEY_IS_HASH) >= 0);
+    it = model.erase(it);
+  }
+}
+
+// Check that `hm` holds exactly the items of `model`.
+void check_map(const HM *hm, std::map<uint64_t, uint64_t> &model) {
+  uint64_t value;
+  for (auto &item : model) {
+    EXPECT(hm_lookup(hm, item.first, &value, QF_NO_LOCK | QF_KEY_IS_HASH) >= 0);
+    EXPECT(value == item.second);
+  }
+  QFi qfi;
+  uint64_t nitems = 0, key;
+  if (qf_iterator_from_position(hm, &qfi, 0) >= 0) {
+    for (; !qfi_end(&qfi); qfi_next(&qfi), nitems++) {
+      EXPECT(qfi_get_key(&qfi, &key, &value) == 0);
+      EXPECT(model.count(key));
+    }
+  }
+  EXPECT(nitems == model.size());
+}
+
+#ifdef QF_CIRCULAR
+// Runs of the last quotients wrap around into the first slots.
+void test_circular_wraparound() {
+  const uint64_t nslots = 1ULL << quotient_bits;
+  const uint64_t remainder_bits = key_bits - quotient_bits;
+  HM hm;
+  new_map(&hm);
+  std::map<uint64_t, uint64_t> model;
+  for (uint64_t q : {nslots - 1, nslots - 2, (uint64_t)0}) {
+    for (uint64_t r = 0; r < 24 && r < (1ULL << remainder_bits); r++) {
+      uint64_t key = q << remainder_bits | r;
+      EXPECT(hm_insert(&hm, key, r & BITMASK(value_bits),
+                       QF_NO_LOCK | QF_KEY_IS_HASH) >= 0);
+      model[key] = r & BITMASK(value_bits);
+    }
+  }
+  check_map(&hm, model);
+  fill_map(&hm, model, nslots * initial_load_factor / 100);
+  check_map(&hm, model);
+  // Remove the wrapped runs first, the runs after them shift back.
+  for (uint64_t q : {nslots - 1, nslots - 2}) {
+    for (uint64_t r = 0; r < 24 && r < (1ULL << remainder_bits); r++) {
+      EXPECT(hm_remove(&hm, q << remainder_bits | r,
+                       QF_NO_LOCK | QF_KEY_IS_HASH) >= 0);
+      model.erase(q << remainder_bits | r);
+    }
+    check_map(&hm, model);
+  }
+  hm_free(&hm);
+}
+#endif
+
+bool key_in_thirds(uint64_t key, uint64_t value, void *arg) {
+  return key % 3 == *(uint64_t *)arg;
+}
+
+bool key_has_quotient(uint64_t key, uint64_t value, void *arg) {
+  return key >> (key_bits - quotient_bits) == *(uint64_t *)arg;
+}
+
+// hm_erase_if removes exactly the matching items, and the rest stay
+// reachable, also in the runs that wrap around a circular table.
+void test_erase_if() {
+  HM hm;
+  new_map(&hm);
+  std::map<uint64_t, uint64_t> model;
+  fill_map(&hm, model, (1ULL << quotient_bits) * initial_load_factor / 100);
+  for (uint64_t third = 0; third < 2; third++) {
+    int64_t expected = 0;
+    for (auto it = model.begin(); it != model.end();) {
+      if (it->first % 3 == third) {
+        it = model.erase(it);
+        expected++;
+      } else {
+        it++;
+      }
+    }
+    EXPECT(hm_erase_if(&hm, key_in_thirds, &third, third == 1) == expected);
+    check_map(&hm, model);
+  }
+  uint64_t none = 3;
+  EXPECT(hm_erase_if(&hm, key_in_thirds, &none, false) == 0);
+  // The erased keys can be inserted again.
+  fill_map(&hm, model, (1ULL << quotient_bits) * initial_load_factor / 100);
+  check_map(&hm, model);
+  hm_free(&hm);
+
+#ifdef QF_CIRCULAR
+  // The last run wraps into the slots of quotient 0's run.
+  const uint64_t nslots = 1ULL << quotient_bits;
+  const uint64_t remainder_bits = key_bits - quotient_bits;
+  new_map(&hm);
+  model.clear();
+  for (uint64_t q : {nslots - 1, (uint64_t)0}) {
+    for (uint64_t r = 0; r < (q ? 20 : 5) && r < (1ULL << remainder_bits);
+         r++) {
+      EXPECT(hm_insert(&hm, q << remainder_bits | r, r & BITMASK(value_bits),
+                       QF_NO_LOCK | QF_KEY_IS_HASH) >= 0);
+      model[q << remainder_bits | r] = r & BITMASK(value_bits);
+    }
+  }
+  uint64_t quotient = 0;
+  EXPECT(hm_erase_if(&hm, key_has_quotient, &quotient, true) ==
+         (int64_t)std::min<uint64_t>(5, 1ULL << remainder_bits));
+  for (auto it = model.begin(); it != model.end();)
+    it = it->first >> remainder_bits == 0 ? model.erase(it) : std::next(it);
+  check_map(&hm, model);
+  hm_free(&hm);
+#endif
+}
+
+// Values are rewritten in place: no tombstones, nelts stays put.
+void test_read_modify_write() {
+  const uint64_t mask = BITMASK(value_bits);
+  const uint8_t flags = QF_NO_LOCK | QF_KEY_IS_HASH;
+  HM hm;
+  new_map(&hm);
+  std::map<uint64_t, uint64_t> model;
+  fill_map(&hm, model, (1ULL << quotient_bits) * initial_load_factor / 200);
+  uint64_t old_value, expected;
+  for (auto &item : model) {
+    switch (item.first % 3) {
+    case 0:
+      EXPECT(hm_upsert(&hm, item.first, item.second + 1, flags) == 1);
+      item.second = (item.second + 1) & mask;
+      break;
+    case 1:
+      // Wraps at value_bits.
+      EXPECT(hm_fetch_add(&hm, item.first, mask, &old_value, flags) == 1);
+      EXPECT(old_value == item.second);
+      item.second = (item.second + mask) & mask;
+      break;
+    case 2:
+      expected = item.second + 1;
+      if ((expected & mask) != item.second) {
+        EXPECT(hm_compare_exchange(&hm, item.first, &expected, 0, flags) ==
+               QF_VALUE_MISMATCH);
+        EXPECT(expected == item.second);
+      }
+      EXPECT(hm_compare_exchange(&hm, item.first, &expected, 1, flags) == 0);
+      item.second = 1 & mask;
+      break;
+    }
+  }
+  EXPECT(hm.metadata->nelts == model.size());
+  check_map(&hm, model);
+
+  // Missing keys are inserted, except by hm_compare_exchange.
+  for (int i = 0; i < 30; i++) {
+    uint64_t key = random_key();
+    if (model.count(key))
+      continue;
+    expected = 0;
+    EXPECT(hm_compare_exchange(&hm, key, &expected, 1, flags) ==
+           QF_DOESNT_EXIST);
+    if (i % 2) {
+      EXPECT(hm_upsert(&hm, key, 3, flags) == 0);
+    } else {
+      EXPECT(hm_fetch_add(&hm, key, 3, &old_value, flags) == 0);
+      EXPECT(old_value == 0);
+    }
+    model[key] = 3 & mask;
+  }
+  check_map(&hm, model);
+  hm_free(&hm);
+}
+
+// A handle is used in place while the epoch matches and probes again after
+// anything moved.
+void test_slot_handles() {
+  const uint64_t mask = BITMASK(value_bits);
+  const uint8_t flags = QF_NO_LOCK | QF_KEY_IS_HASH;
+  HM hm;
+  new_map(&hm);
+  std::map<uint64_t, uint64_t> model;
+  fill_map(&hm, model, (1ULL << quotient_bits) * initial_load_factor / 200);
+  std::vector<uint64_t> keys;
+  for (auto &item : model)
+    keys.push_back(item.first);
+
+  hm_handle handle;
+  uint64_t value;
+  for (size_t i = 0; i < keys.size(); i++) {
+    EXPECT(hm_find_handle(&hm, keys[i], &value, &handle, flags) == 0);
+    EXPECT(value == model[keys[i]]);
+    EXPECT(handle.epoch == hm.metadata->epoch);
+    EXPECT(hm_update_handle(&hm, &handle, i) == 0);
+    model[keys[i]] = i & mask;
+    if (i % 2 == 0)
+      continue;
+    // Remove the key before, the handle has to find its key again.
+    EXPECT(hm_remove(&hm, keys[i - 1], flags) >= 0);
+    model.erase(keys[i - 1]);
+    EXPECT(handle.epoch != hm.metadata->epoch);
+    EXPECT(hm_update_handle(&hm, &handle, i + 1) == 0);
+    EXPECT(handle.epoch == hm.metadata->epoch);
+    model[keys[i]] = (i + 1) & mask;
+  }
+  check_map(&hm, model);
+
+  // A handle to a missing key finds it once it is inserted.
+  EXPECT(hm_find_handle(&hm, keys[0], NULL, &handle, flags) ==
+         QF_DOESNT_EXIST);
+  EXPECT(hm_update_handle(&hm, &handle, 1) == QF_DOESNT_EXIST);
+  EXPECT(hm_insert(&hm, keys[0], 0, flags) >= 0);
+  EXPECT(hm_update_handle(&hm, &handle, 1) == 0);
+  model[keys[0]] = 1 & mask;
+  check_map(&hm, model);
+
+  // An erased handle is stale and its key gone.
+  EXPECT(hm_find_handle(&hm, keys[1], NULL, &handle, flags) == 0);
+  EXPECT(hm_erase_handle(&hm, &handle) >= 0);
+  model.erase(keys[1]);
+  EXPECT(hm_update_handle(&hm, &handle, 1) == QF_DOESNT_EXIST);
+  EXPECT(hm_erase_handle(&hm, &handle) == QF_DOESNT_EXIST);
+  check_map(&hm, model);
+  hm_free(&hm);
+}
+
+// Fingerprints two bits past the quotient collide often, so keys chain
+// through the arena. The slots keep the width of the run's.
+void test_hm_str() {
+  const uint64_t fingerprint_bits = quotient_bits + 2;
+  const uint64_t ref_bits = key_bits - fingerprint_bits + value_bits;
+  const uint64_t nkeys = (1ULL << quotient_bits) * initial_load_factor / 100;
+  HMS hms;
+  EXPECT(hm_str_malloc(&hms, 1ULL << quotient_bits, fingerprint_bits, ref_bits,
+                       0, 0.95));
+  std::map<std::string, uint64_t> model;
+  char key[32];
+  uint64_t value;
+  // Keys of one length take as many arena units each, so after a compaction
+  // a key fits in place of one removed.
+  auto insert = [&](uint64_t i) {
+    snprintf(key, sizeof(key), "key-%08lu", i);
+    int ret = hm_str_insert(&hms, key, strlen(key), i * 7919, QF_NO_LOCK);
+    if (ret == QF_NO_SPACE) {
+      EXPECT(hm_str_compact(&hms, QF_NO_LOCK) == 0);
+      ret = hm_str_insert(&hms, key, strlen(key), i * 7919, QF_NO_LOCK);
+    }
+    if (ret >= 0)
+      model[key] = i * 7919;
+    return ret;
+  };
+  auto check = [&]() {
+    for (auto &item : model) {
+      EXPECT(hm_str_lookup(&hms, item.first.data(), item.first.size(), &value,
+                           QF_NO_LOCK) == 0);
+      EXPECT(value == item.second);
+    }
+    for (uint64_t i = 0; i < nkeys; i++) {
+      snprintf(key, sizeof(key), "absent-%lu", i);
+      EXPECT(hm_str_lookup(&hms, key, strlen(key), &value, QF_NO_LOCK) ==
+             QF_DOESNT_EXIST);
+    }
+  };
+
+  // Fill the table, or the arena when references are narrow.
+  for (uint64_t i = 0; i < nkeys && insert(i) != QF_NO_SPACE; i++)
+    ;
+  EXPECT(model.size() > 0);
+  if (model.size() >= 64)
+    EXPECT(hms.hm.metadata->nelts < model.size());
+  const std::string first = model.begin()->first;
+  EXPECT(hm_str_insert(&hms, first.data(), first.size(), 0, QF_NO_LOCK) ==
+         QF_KEY_EXISTS);
+  check();
+
+  // Remove from the heads, middles and ends of the chains.
+  uint64_t n = 0;
+  for (auto it = model.begin(); it != model.end(); n++) {
+    if (n % 2) {
+      it++;
+      continue;
+    }
+    EXPECT(hm_str_remove(&hms, it->first.data(), it->first.size(),
+                         QF_NO_LOCK) >= 0);
+    EXPECT(hm_str_remove(&hms, it->first.data(), it->first.size(),
+                         QF_NO_LOCK) == QF_DOESNT_EXIST);
+    it = model.erase(it);
+  }
+  check();
+  const uint64_t live_units = hms.used_units - hms.dead_units;
+  EXPECT(hm_str_compact(&hms, QF_NO_LOCK) == 0);
+  EXPECT(hms.dead_units == 0 && hms.used_units == live_units);
+  check();
+
+  // Replace keys until removals have compacted the arena by themselves.
+  bool compacted = false;
+  for (uint64_t i = nkeys; i < 8 * nkeys; i++) {
+    const std::string victim = model.begin()->first;
+    const uint64_t dead_units = hms.dead_units;
+    EXPECT(hm_str_remove(&hms, victim.data(), victim.size(), QF_NO_LOCK) >= 0);
+    model.erase(victim);
+    compacted |= dead_units > 0 && hms.dead_units == 0;
+    EXPECT(insert(i) >= 0);
+  }
+  // Without room for the dead entries, compactions were explicit.
+  if (hms.max_units >= 8 * nkeys * 8)
+    EXPECT(compacted);
+  check();
+  hm_str_free(&hms);
+}
+
+// Counters stop at the largest value the value bits hold.
+void test_count_saturation() {
+  const uint64_t max_count = BITMASK(value_bits);
+  const uint8_t flags = QF_NO_LOCK | QF_KEY_IS_HASH;
+  HM hm;
+  new_map(&hm);
+  uint64_t key = random_key();
+  if (value_bits == 0) {
+    EXPECT(hm_count_insert(&hm, key, 1, flags) == QF_INVALID);
+    EXPECT(hm_count_remove(&hm, key, 1, flags) == QF_INVALID);
+    hm_free(&hm);
+    return;
+  }
+  EXPECT(hm_count_insert(&hm, key, max_count + 1, flags) == 0);
+  EXPECT(hm_count(&hm, key, flags) == max_count);
+  EXPECT(hm_count_remove(&hm, key, 1, flags) == (max_count > 1 ? 1 : 0));
+  EXPECT(hm_count(&hm, key, flags) == max_count - 1);
+  if (max_count > 1) {
+    EXPECT(hm_count_insert(&hm, key, 1, flags) == 1);
+    EXPECT(hm_count(&hm, key, flags) == max_count);
+    EXPECT(hm_count_insert(&hm, key, max_count, flags) == 1);
+    EXPECT(hm_count(&hm, key, flags) == max_count);
+    EXPECT(hm_count_remove(&hm, key, max_count - 1, flags) == 1);
+    EXPECT(hm_count(&hm, key, flags) == 1);
+    EXPECT(hm_count_remove(&hm, key, 1, flags) == 0);
+  }
+  EXPECT(hm_count(&hm, key, flags) == 0);
+  EXPECT(hm_count_remove(&hm, key, 1, flags) == QF_DOESNT_EXIST);
+
+  // Counters of the keys around saturated ones stay exact.
+  std::map<uint64_t, uint64_t> model;
+  for (uint64_t i = 0; i < (1ULL << quotient_bits) * initial_load_factor / 100;
+       i++) {
+    key = random_key();
+    const uint64_t count = i % 2 ? max_count : 1;
+    EXPECT(hm_count_insert(&hm, key, count, flags) >= 0);
+    model[key] = std::min(model[key] + count, max_count);
+  }
+  check_map(&hm, model);
+  hm_free(&hm);
+}
+
+#ifdef QF_TTL
+// Items are there up to the tick before their expiry time, also when the
+// clock wraps around QF_TTL_BITS, and gone from then on.
+void test_ttl_expiry() {
+  const uint8_t flags = QF_NO_LOCK | QF_KEY_IS_HASH;
+  const uint64_t ttl = 10, now = BITMASK(QF_TTL_BITS) - ttl / 2;
+  HM hm;
+  new_map(&hm);
+  hm_set_clock(&hm, now);
+  std::map<uint64_t, uint64_t> model, expiring;
+  fill_map(&hm, model, (1ULL << quotient_bits) * initial_load_factor / 200);
+  while (expiring.size() < model.size()) {
+    uint64_t key = random_key(), value = rand() & BITMASK(value_bits);
+    if (model.count(key) || expiring.count(key))
+      continue;
+    EXPECT(hm_insert_ttl(&hm, key, value, ttl, flags) >= 0);
+    expiring[key] = value;
+  }
+  std::map<uint64_t, uint64_t> all(model);
+  all.insert(expiring.begin(), expiring.end());
+
+  hm_set_clock(&hm, now + ttl - 1);
+  check_map(&hm, all);
+  hm_set_clock(&hm, now + ttl);
+  check_map(&hm, model);
+  uint64_t value;
+  for (auto &item : expiring) {
+    EXPECT(hm_lookup(&hm, item.first, &value, flags) == QF_DOESNT_EXIST);
+    EXPECT(hm_remove(&hm, item.first, flags) == QF_DOESNT_EXIST);
+  }
+
+  // Reinserting an expired key takes its slot.
+  for (auto &item : expiring) {
+    if (item.first % 2)
+      continue;
+    EXPECT(hm_insert(&hm, item.first, item.second, flags) >= 0);
+    model[item.first] = item.second;
+  }
+  check_map(&hm, model);
+  hm_free(&hm);
+}
+#endif
+
+#ifdef QF_CACHE
+// Inserts past the capacity evict one item each, and the cache only ever
+// holds items that were inserted, with their values.
+void test_cache_eviction() {
+  const uint8_t flags = QF_NO_LOCK | QF_KEY_IS_HASH;
+  HM hm;
+  new_map(&hm);
+  const uint64_t capacity = hm.metadata->cache_capacity;
+  std::map<uint64_t, uint64_t> inserted;
+  uint64_t value;
+  while (inserted.size() < 4 * capacity) {
+    uint64_t key = random_key(), new_value = rand() & BITMASK(value_bits);
+    if (inserted.count(key))
+      continue;
+    EXPECT(hm_cache_insert(&hm, key, new_value, flags) >= 0);
+    inserted[key] = new_value;
+    EXPECT(hm.metadata->nelts == std::min<uint64_t>(inserted.size(), capacity));
+    EXPECT(hm_cache_lookup(&hm, key, &value, flags) == 0);
+    EXPECT(value == new_value);
+    EXPECT(hm_cache_insert(&hm, key, new_value, flags) == QF_KEY_EXISTS);
+  }
+
+  std::map<uint64_t, uint64_t> cached;
+  for (auto &item : inserted)
+    if (hm_lookup(&hm, item.first, &value, flags) >= 0)
+      cached[item.first] = value;
+  EXPECT(cached.size() == capacity);
+  for (auto &item : cached)
+    EXPECT(item.second == inserted[item.first]);
+  check_map(&hm, cached);
+  hm_free(&hm);
+}
+#endif
+
+// Batches hold the items qfi_get_hash and qfi_next step through, in the
+// same order, whatever their size.
+void test_next_batch() {
+  HM hm;
+  new_map(&hm);
+  std::map<uint64_t, uint64_t> model;
+  fill_map(&hm, model, (1ULL << quotient_bits) * initial_load_factor / 100);
+  uint64_t n = 0;
+  for (auto it = model.begin(); it != model.end(); n++) {
+    if (n % 3) {
+      it++;
+      continue;
+    }
+    EXPECT(hm_remove(&hm, it->first, QF_NO_LOCK | QF_KEY_IS_HASH) >= 0);
+    it = model.erase(it);
+  }
+
+  std::vector<uint64_t> hashes, values;
+  QFi qfi;
+  uint64_t hash, value;
+  if (qf_iterator_from_position(&hm, &qfi, 0) >= 0) {
+    for (; !qfi_end(&qfi); qfi_next(&qfi)) {
+      EXPECT(qfi_get_hash(&qfi, &hash, &value) == 0);
+      hashes.push_back(hash);
+      values.push_back(value);
+    }
+  }
+  EXPECT(hashes.size() == model.size());
+
+  uint64_t batch_hashes[QF_JOIN_BATCH], batch_values[QF_JOIN_BATCH];
+  for (size_t max : {(size_t)1, (size_t)7, (size_t)64, (size_t)QF_JOIN_BATCH}) {
+    size_t i = 0, got;
+    if (qf_iterator_from_position(&hm, &qfi, 0) >= 0) {
+      while ((got = qfi_next_batch(&qfi, batch_hashes, batch_values, max)) >
+             0) {
+        EXPECT(got <= max && i + got <= hashes.size());
+        for (size_t j = 0; j < got; j++, i++) {
+          EXPECT(batch_hashes[j] == hashes[i]);
+          EXPECT(batch_values[j] == values[i]);
+        }
+        // The iterator stops on the next item, as qfi_next leaves it.
+        if (!qfi_end(&qfi)) {
+          EXPECT(qfi_get_hash(&qfi, &hash, &value) == 0);
+          EXPECT(hash == hashes[i]);
+        }
+      }
+    }
+    EXPECT(i == hashes.size());
+  }
+  hm_free(&hm);
+}
+
+// Each set operation against std::map, whole and in parallel ranges, on
+// inputs that share some keys. The second input is larger where slots may
+// be of any width.
+void test_set_operations() {
+#if QF_BITS_PER_SLOT == 0
+  const uint64_t qbits_b = quotient_bits + 1;
+#else
+  const uint64_t qbits_b = quotient_bits;
+#endif
+  const uint64_t nkeys = (1ULL << quotient_bits) * initial_load_factor / 300;
+  HM a, b;
+  new_map(&a);
+  new_map(&b, qbits_b);
+  std::map<uint64_t, uint64_t> model_a, model_b;
+  fill_map(&a, model_a, nkeys);
+  for (auto &item : model_a) {
+    if (item.first % 2)
+      continue;
+    const uint64_t value = ~item.second & BITMASK(value_bits);
+    EXPECT(hm_insert(&b, item.first, value, QF_NO_LOCK | QF_KEY_IS_HASH) >= 0);
+    model_b[item.first] = value;
+  }
+  fill_map(&b, model_b, nkeys);
+
+  for (int op = QF_INTERSECTION; op <= QF_SYMMETRIC_DIFFERENCE; op++) {
+    // A key in both keeps its value in `a`.
+    std::map<uint64_t, uint64_t> expected;
+    for (auto &item : model_a) {
+      const bool in_b = model_b.count(item.first);
+      if (op == QF_UNION || (op == QF_INTERSECTION) == in_b)
+        expected[item.first] = item.second;
+    }
+    if (op == QF_UNION || op == QF_SYMMETRIC_DIFFERENCE)
+      for (auto &item : model_b)
+        if (!model_a.count(item.first))
+          expected[item.first] = item.second;
+
+    for (uint32_t nthreads = 0; nthreads <= 3; nthreads++) {
+      HM c;
+      new_map(&c);
+      int64_t ret;
+      if (nthreads > 0)
+        ret = qf_merge_parallel(&a, &b, &c, (enum qf_set_op)op, nthreads);
+      else if (op == QF_INTERSECTION)
+        ret = qf_join(&a, &b, &c);
+      else if (op == QF_UNION)
+        ret = qf_union(&a, &b, &c);
+      else if (op == QF_DIFFERENCE)
+        ret = qf_difference(&a, &b, &c);
+      else
+        ret = qf_symdiff(&a, &b, &c);
+      EXPECT(ret == (int64_t)expected.size());
+      check_map(&c, expected);
+      hm_free(&c);
+    }
+  }
+
+  // Tables that hash keys differently can't be merged.
+  HM other, c;
+  new_map(&other, quotient_bits, 1);
+  new_map(&c);
+  EXPECT(qf_union(&a, &other, &c) == QF_INVALID);
+  EXPECT(qf_merge_parallel(&a, &other, &c, QF_UNION, 2) == QF_INVALID);
+  hm_free(&other);
+  hm_free(&c);
+  hm_free(&a);
+  hm_free(&b);
+}
+
+// Partition p of 2^k holds the keys starting with the k bits of p, without
+// them, and merging the partitions gives the map back.
+void test_split_merge() {
+  HM hm;
+  new_map(&hm);
+  std::map<uint64_t, uint64_t> model;
+  fill_map(&hm, model, (1ULL << quotient_bits) * initial_load_factor / 100);
+  for (uint32_t k = 1; (1ULL << quotient_bits >> k) >= QF_SLOTS_PER_BLOCK;
+       k++) {
+    std::vector<HM> parts(1ULL << k);
+#if defined(QF_CIRCULAR) || defined(QF_VALUE_POOL)
+    EXPECT(hm_split(&hm, k, parts.data()) == QF_INVALID);
+    break;
+#endif
+    const uint64_t part_key_bits = key_bits - k;
+    std::vector<std::map<uint64_t, uint64_t>> part_models(parts.size());
+    for (auto &item : model)
+      part_models[item.first >> part_key_bits]
+                 [item.first & BITMASK(part_key_bits)] = item.second;
+    // Stop before a partition gets more keys than its slots hold.
+    bool fits = true;
+    for (auto &part_model : part_models)
+      fits &= part_model.size() <= 0.95 * (1ULL << quotient_bits >> k);
+    if (!fits)
+      break;
+    EXPECT(hm_split(&hm, k, parts.data()) == 0);
+    for (size_t p = 0; p < parts.size(); p++) {
+      EXPECT(parts[p].metadata->key_bits == part_key_bits);
+      check_map(&parts[p], part_models[p]);
+    }
+
+    HM merged;
+    EXPECT(hm_merge(parts.data(), k, &merged) == 0);
+    check_map(&merged, model);
+    // The merged map takes inserts and removes like the original.
+    std::map<uint64_t, uint64_t> merged_model(model);
+    auto victim = merged_model.begin();
+    EXPECT(hm_remove(&merged, victim->first, QF_NO_LOCK | QF_KEY_IS_HASH) >=
+           0);
+    merged_model.erase(victim);
+    fill_map(&merged, merged_model, model.size());
+    check_map(&merged, merged_model);
+    hm_free(&merged);
+    for (auto &part : parts)
+      hm_free(&part);
+  }
+
+  // Partitions of maps with different seeds don't go together.
+  HM parts[2], merged;
+  for (uint32_t seed = 0; seed < 2; seed++)
+    EXPECT(hm_malloc(&parts[seed], 1ULL << (quotient_bits - 1), key_bits - 1,
+                     value_bits, QF_HASH_NONE, seed, 0.95));
+#if !defined(QF_CIRCULAR) && !defined(QF_VALUE_POOL)
+  EXPECT(hm_merge(parts, 1, &merged) == QF_INVALID);
+#endif
+  hm_free(&parts[0]);
+  hm_free(&parts[1]);
+  hm_free(&hm);
+}
+
+typedef std::vector<std::pair<uint64_t, uint64_t>> item_list;
+
+void collect_scan(const uint64_t *keys, const uint64_t *values, size_t n,
+                  void *arg) {
+  EXPECT(n > 0 && n <= QF_JOIN_BATCH);
+  for (size_t i = 0; i < n; i++)
+    ((item_list *)arg)->emplace_back(keys[i], values[i]);
+}
+
+// A scan passes the items of its range in key order (quotient order under
+// UNORDERED), empty and full ranges included.
+void test_scan_range() {
+  HM hm;
+  new_map(&hm);
+  std::map<uint64_t, uint64_t> model;
+  churn_map(&hm, model);
+  const uint64_t max_key = BITMASK(key_bits);
+  item_list ranges = {{0, max_key + 1}, {0, UINT64_MAX}, {max_key, UINT64_MAX},
+                      {max_key / 2, max_key / 2}, {max_key / 2, max_key / 4}};
+  for (int i = 0; i < 100; i++) {
+    uint64_t lo = random_key(), hi = random_key();
+    ranges.emplace_back(std::min(lo, hi), std::max(lo, hi));
+  }
+  // Ranges within a run.
+  for (auto it = model.begin(); it != model.end() && ranges.size() < 150;
+       std::advance(it, std::min<size_t>(7, std::distance(it, model.end()))))
+    ranges.emplace_back(it->first, it->first + 1 + rand() % 4);
+
+  for (auto &range : ranges) {
+    item_list expected, got;
+    if (range.first < range.second)
+      expected.assign(model.lower_bound(range.first),
+                      model.lower_bound(range.second));
+    EXPECT(hm_scan_range(&hm, range.first, range.second, collect_scan, &got) ==
+           (int64_t)expected.size());
+#ifdef UNORDERED
+    const uint64_t remainder_bits = key_bits - quotient_bits;
+    for (size_t i = 1; i < got.size(); i++)
+      EXPECT(got[i - 1].first >> remainder_bits <=
+             got[i].first >> remainder_bits);
+    std::sort(got.begin(), got.end());
+#endif
+    EXPECT(got == expected);
+  }
+  hm_free(&hm);
+}
+
+void collect_for_each(const uint64_t *keys, const uint64_t *values, size_t n,
+                      uint32_t thread, void *arg) {
+  std::vector<item_list> *seen = (std::vector<item_list> *)arg;
+  EXPECT(n > 0 && thread < seen->size());
+  for (size_t i = 0; i < n; i++)
+    (*seen)[thread].emplace_back(keys[i], values[i]);
+}
+
+struct value_sum {
+  uint64_t sum, count;
+};
+
+void reduce_sum(void *partial, const uint64_t *keys, const uint64_t *values,
+                size_t n, void *arg) {
+  for (size_t i = 0; i < n; i++)
+    ((value_sum *)partial)->sum += values[i];
+  ((value_sum *)partial)->count += n;
+}
+
+void combine_sum(void *result, const void *partial, void *arg) {
+  ((value_sum *)result)->sum += ((const value_sum *)partial)->sum;
+  ((value_sum *)result)->count += ((const value_sum *)partial)->count;
+}
+
+// Every item is seen exactly once whatever the number of threads, also with
+// more threads than blocks.
+void test_parallel_for_each() {
+  HM hm;
+  new_map(&hm);
+  std::map<uint64_t, uint64_t> model;
+  churn_map(&hm, model);
+#ifdef QF_TOMBSTONE
+  EXPECT(hm.metadata->noccupied_slots > hm.metadata->nelts);
+#endif
+  uint64_t sum = 0;
+  for (auto &item : model)
+    sum += item.second;
+  for (uint32_t nthreads : {1u, 3u, (uint32_t)hm.metadata->nblocks + 1}) {
+    std::vector<item_list> seen(nthreads);
+    EXPECT(hm_parallel_for_each(&hm, nthreads, collect_for_each, &seen) ==
+           (int64_t)model.size());
+    std::map<uint64_t, uint64_t> got;
+    for (auto &items : seen)
+      for (auto &item : items)
+        EXPECT(got.insert(item).second);
+    EXPECT(got == model);
+
+    value_sum result = {0, 0};
+    EXPECT(hm_parallel_reduce(&hm, nthreads, &result, sizeof(result),
+                              reduce_sum, combine_sum, NULL) ==
+           (int64_t)model.size());
+    EXPECT(result.sum == sum && result.count == model.size());
+  }
+  hm_free(&hm);
+}
+
+typedef std::tuple<uint64_t, uint64_t, uint64_t> join_tuple;
+
+void collect_join(const uint64_t *keys, const uint64_t *values_a,
+                  const uint64_t *values_b, size_t n, uint32_t thread,
+                  void *arg) {
+  std::vector<std::vector<join_tuple>> *seen =
+      (std::vector<std::vector<join_tuple>> *)arg;
+  EXPECT(n > 0 && n <= QF_JOIN_BATCH && thread < seen->size());
+  for (size_t i = 0; i < n; i++)
+    (*seen)[thread].emplace_back(keys[i], values_a[i], values_b[i]);
+}
+
+// A streamed join passes each common key once, with its values in both
+// maps, in several batches. The maps have at least 2^12 slots and keys as
+// much wider, so slots keep their width.
+void test_join_stream() {
+  const uint64_t extra_bits = quotient_bits < 12 ? 12 - quotient_bits : 0;
+  const uint64_t nbits = key_bits + extra_bits;
+  const uint64_t nslots = 1ULL << (quotient_bits + extra_bits);
+  HM a, b;
+  EXPECT(hm_malloc(&a, nslots, nbits, value_bits, QF_HASH_NONE, 0, 0.95));
+  EXPECT(hm_malloc(&b, nslots, nbits, value_bits, QF_HASH_NONE, 0, 0.95));
+  std::map<uint64_t, uint64_t> model_a, model_b;
+  fill_map(&a, model_a, nslots * 8 / 10, nbits);
+  for (auto &item : model_a) {
+    if (item.first % 4 == 0)
+      continue;
+    const uint64_t value = ~item.second & BITMASK(value_bits);
+    EXPECT(hm_insert(&b, item.first, value, QF_NO_LOCK | QF_KEY_IS_HASH) >= 0);
+    model_b[item.first] = value;
+  }
+  fill_map(&b, model_b, nslots * 8 / 10, nbits);
+
+  std::vector<join_tuple> expected;
+  for (auto &item : model_a)
+    if (model_b.count(item.first))
+      expected.emplace_back(item.first, item.second, model_b[item.first]);
+  EXPECT(expected.size() > QF_JOIN_BATCH);
+
+  for (uint32_t nthreads : {1u, 2u, 3u, 8u}) {
+    std::vector<std::vector<join_tuple>> seen(nthreads);
+    EXPECT(qf_join_stream(&a, &b, nthreads, collect_join, &seen) ==
+           (int64_t)expected.size());
+    std::vector<join_tuple> got;
+    for (auto &tuples : seen) {
+#ifndef UNORDERED
+      EXPECT(std::is_sorted(tuples.begin(), tuples.end()));
+#endif
+      got.insert(got.end(), tuples.begin(), tuples.end());
+    }
+    std::sort(got.begin(), got.end());
+    EXPECT(std::adjacent_find(got.begin(), got.end()) == got.end());
+    EXPECT(got == expected);
+  }
+  hm_free(&a);
+  hm_free(&b);
+}
+
+// The aggregate of `op` after folding `value` into `aggregate`, wrapping at
+// value_bits.
+uint64_t fold_value(enum hm_agg_op op, uint64_t aggregate, uint64_t value) {
+  const uint64_t mask = BITMASK(value_bits);
+  switch (op) {
+  case HM_AGG_COUNT:
+    return (aggregate + 1) & mask;
+  case HM_AGG_SUM:
+    return (aggregate + value) & mask;
+  case HM_AGG_MIN:
+    return std::min(aggregate, value & mask);
+  default:
+    return std::max(aggregate, value & mask);
+  }
+}
+
+// Aggregates fold in place and wrap at value_bits. Merging folds the items
+// of another map in, inserting its keys missing from the first.
+void test_aggregate() {
+  const uint64_t mask = BITMASK(value_bits);
+  const uint8_t flags = QF_NO_LOCK | QF_KEY_IS_HASH;
+  const uint64_t nkeys = std::max<uint64_t>(
+      2, (1ULL << quotient_bits) * initial_load_factor / 300);
+  for (int i = HM_AGG_COUNT; i <= HM_AGG_MAX; i++) {
+    const enum hm_agg_op op = (enum hm_agg_op)i;
+    HM hm;
+    new_map(&hm);
+    std::map<uint64_t, uint64_t> model;
+    std::vector<uint64_t> keys;
+    while (keys.size() < nkeys)
+      keys.push_back(random_key());
+    // One key gets folded into past the largest value.
+    for (uint64_t n = 0; n < 8 * nkeys + mask + 2; n++) {
+      const uint64_t key = n <= mask + 1 ? keys[0] : keys[rand() % nkeys];
+      const uint64_t value = ((uint64_t)rand() << 33) ^ rand();
+      const bool present = model.count(key);
+      EXPECT(hm_aggregate(&hm, key, value, op, flags) == present);
+      model[key] = present ? fold_value(op, model[key], value)
+                           : (op == HM_AGG_COUNT ? 1 : value) & mask;
+    }
+    check_map(&hm, model);
+    hm_free(&hm);
+
+    // COUNT merges add up the partial counts.
+    const enum hm_agg_op merge_op = op == HM_AGG_COUNT ? HM_AGG_SUM : op;
+    for (uint32_t nthreads : {1u, 3u}) {
+      HM dst, src;
+      new_map(&dst);
+      new_map(&src);
+      std::map<uint64_t, uint64_t> model_dst, model_src;
+      fill_map(&dst, model_dst, nkeys);
+      for (auto &item : model_dst) {
+        if (item.first % 2)
+          continue;
+        const uint64_t value = rand() & mask;
+        EXPECT(hm_insert(&src, item.first, value, flags) >= 0);
+        model_src[item.first] = value;
+      }
+      fill_map(&src, model_src, model_src.size() + nkeys / 2);
+      std::map<uint64_t, uint64_t> expected(model_dst);
+      uint64_t nmissing = 0;
+      for (auto &item : model_src) {
+        if (expected.count(item.first)) {
+          expected[item.first] =
+              fold_value(merge_op, expected[item.first], item.second);
+        } else {
+          expected[item.first] = item.second;
+          nmissing++;
+        }
+      }
+      EXPECT(nmissing > 0);
+      EXPECT(hm_aggregate_merge(&dst, &src, op, nthreads, flags) ==
+             (int64_t)model_src.size());
+      check_map(&dst, expected);
+      hm_free(&dst);
+      hm_free(&src);
+    }
+  }
+
+  // Maps that hash keys differently can't be merged.
+  HM dst, src;
+  new_map(&dst);
+  new_map(&src, quotient_bits, 1);
+  EXPECT(hm_aggregate_merge(&dst, &src, HM_AGG_SUM, 2, flags) == QF_INVALID);
+  hm_free(&dst);
+  hm_free(&src);
+}
+
+// Two keys whose fingerprints collide in a QF_HASH_DEFAULT map with `nbits`
+// key bits and seed 0.
+std::pair<uint64_t, uint64_t> colliding_keys(uint64_t nbits) {
+  std::map<uint64_t, uint64_t> seen;
+  for (uint64_t key = ((uint64_t)rand() << 33) ^ rand();; key++) {
+    auto it = seen.emplace(MurmurHash64A_u64(key, 0) & BITMASK(nbits), key);
+    if (!it.second)
+      return std::make_pair(it.first->second, key);
+  }
+}
+
+// Keys sharing a fingerprint are counted, so removing one keeps the others,
+// except with 1 value bit where the count saturates.
+void test_filter() {
+  const uint8_t flags = QF_NO_LOCK;
+  const uint64_t nkeys = (1ULL << quotient_bits) * initial_load_factor / 100;
+  HM hm;
+  EXPECT(hm_malloc(&hm, 1ULL << quotient_bits, key_bits, value_bits,
+                   QF_HASH_DEFAULT, 0, 0.95));
+  std::pair<uint64_t, uint64_t> keys = colliding_keys(key_bits);
+  if (value_bits == 0) {
+    EXPECT(hm_filter_insert(&hm, keys.first, flags) == QF_INVALID);
+    EXPECT(hm_filter_remove(&hm, keys.first, flags) == QF_INVALID);
+  } else if (value_bits > 1) {
+    EXPECT(hm_filter_insert(&hm, keys.first, flags) == 0);
+    EXPECT(hm_filter_insert(&hm, keys.second, flags) == 1);
+    EXPECT(hm_count(&hm, keys.first, flags) == 2);
+    EXPECT(hm_filter_remove(&hm, keys.first, flags) == 1);
+    EXPECT(hm_filter_query(&hm, keys.second, flags));
+    EXPECT(hm_filter_remove(&hm, keys.second, flags) == 0);
+    EXPECT(!hm_filter_query(&hm, keys.second, flags));
+    EXPECT(hm_filter_remove(&hm, keys.second, flags) == QF_DOESNT_EXIST);
+  }
+  // No false negatives, and every insert can be taken back while the
+  // counts don't saturate.
+  if (value_bits >= 4) {
+    std::vector<uint64_t> inserted;
+    for (uint64_t i = 0; i < nkeys; i++) {
+      inserted.push_back(((uint64_t)rand() << 33) ^ rand());
+      EXPECT(hm_filter_insert(&hm, inserted.back(), flags) >= 0);
+    }
+    for (uint64_t key : inserted)
+      EXPECT(hm_filter_query(&hm, key, flags));
+    for (uint64_t key : inserted)
+      EXPECT(hm_filter_remove(&hm, key, flags) >= 0);
+    EXPECT(hm.metadata->nelts == 0);
+  }
+  hm_free(&hm);
+
+  // One value bit, one more remainder bit keeps the slots of the run's width.
+  const uint64_t narrow_key_bits = key_bits + value_bits - 1;
+  EXPECT(hm_malloc(&hm, 1ULL << quotient_bits, narrow_key_bits, 1,
+                   QF_HASH_DEFAULT, 0, 0.95));
+  keys = colliding_keys(narrow_key_bits);
+  EXPECT(hm_filter_insert(&hm, keys.first, flags) == 0);
+  EXPECT(hm_filter_insert(&hm, keys.second, flags) == 1);
+  EXPECT(hm_count(&hm, keys.first, flags) == 1);
+  EXPECT(hm_filter_remove(&hm, keys.second, flags) == 0);
+  EXPECT(!hm_filter_query(&hm, keys.first, flags));
+  hm_free(&hm);
+}
+
+// Without QF_KEY_IS_HASH, QF_HASH_DEFAULT maps hash keys with MurmurHash64A
+// and QF_HASH_NONE maps store them as they are, masked to key_bits.
+void test_key_hashing() {
+  const uint32_t seed = 7;
+  for (uint64_t key : {(uint64_t)0, (uint64_t)0xdeadbeef, UINT64_MAX,
+                       ((uint64_t)rand() << 33) ^ rand()})
+    EXPECT(MurmurHash64A_u64(key, seed) ==
+           MurmurHash64A(&key, sizeof(key), seed));
+
+  const uint64_t nkeys = (1ULL << quotient_bits) * initial_load_factor / 200;
+  for (enum qf_hashmode mode : {QF_HASH_DEFAULT, QF_HASH_NONE}) {
+    HM hm;
+    EXPECT(hm_malloc(&hm, 1ULL << quotient_bits, key_bits, value_bits, mode,
+                     seed, 0.95));
+    std::map<uint64_t, uint64_t> keys, hashes;
+    while (keys.size() < nkeys) {
+      const uint64_t key = ((uint64_t)rand() << 33) ^ rand();
+      const uint64_t hash =
+          (mode == QF_HASH_DEFAULT ? MurmurHash64A_u64(key, seed) : key) &
+          BITMASK(key_bits);
+      if (hashes.count(hash))
+        continue;
+      const uint64_t value = rand() & BITMASK(value_bits);
+      EXPECT(hm_insert(&hm, key, value, QF_NO_LOCK) >= 0);
+      keys[key] = value;
+      hashes[hash] = value;
+    }
+    uint64_t value;
+    for (auto &item : keys) {
+      EXPECT(hm_lookup(&hm, item.first, &value, QF_NO_LOCK) >= 0);
+      EXPECT(value == item.second);
+    }
+    // Lookups by hash and the iterator see the hashes.
+    check_map(&hm, hashes);
+
+    uint64_t n = 0;
+    for (auto &item : keys) {
+      if (n++ % 2)
+        continue;
+      EXPECT(hm_remove(&hm, item.first, QF_NO_LOCK) >= 0);
+      EXPECT(hm_lookup(&hm, item.first, &value, QF_NO_LOCK) ==
+             QF_DOESNT_EXIST);
+      hashes.erase((mode == QF_HASH_DEFAULT
+                        ? MurmurHash64A_u64(item.first, seed)
+                        : item.first) &
+                   BITMASK(key_bits));
+    }
+    check_map(&hm, hashes);
+    hm_free(&hm);
+  }
+}
+
+void run_focused_tests() {
+#ifdef QF_CIRCULAR
+  test_circular_wraparound();
+#endif
+  test_read_modify_write();
+  test_slot_handles();
+  test_erase_if();
+  test_hm_str();
+  test_count_saturation();
+  test_next_batch();
+  test_set_operations();
+  test_split_merge();
+  test_scan_range();
+  test_parallel_for_each();
+  test_join_stream();
+  test_aggregate();
+  test_filter();
+  test_key_hashing();
+#ifdef QF_TTL
+  test_ttl_expiry();
+#endif
+#ifdef QF_CACHE
+  test_cache_eviction();
+#endif
+  printf("Focused tests success.\n");
+}
+#endif
+
 void usage(char *name) {
   printf("%s [OPTIONS]\n"
          "Options are:\n"
@@ -217,6 +1267,10 @@ int main(int argc, char **argv) {
   cout << "Is Replay: " << should_replay << std::endl;
   cout << "Test Case Replay File: " << replay_file << std::endl;
 
+#ifdef QFHM_WRAPPER_H
+  run_focused_tests();
+#endif
+
   std::vector<hm_op> ops;
   if (should_replay) {
     load_ops(replay_file, &key_bits, &quotient_bits, &value_bits, ops);